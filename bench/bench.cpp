@@ -0,0 +1,669 @@
+/** @file bench.cpp
+ *
+ * Throughput and latency benchmark for this stdio and the system libc
+ *
+ * The same source is built twice, once against ../stdio.h and once
+ *   against <stdio.h> (BENCH_LIBC), and each binary prints one CSV table:
+ *
+ *   g++ -O2 -o bench/bench_stdio bench/bench.cpp -lpthread && g++ -O2 -DBENCH_LIBC -o bench/bench_libc bench/bench.cpp -lpthread
+ *
+ *   bench/bench_stdio [dir] [scale] [seqscale] > mine.csv
+ *   bench/bench_libc [dir] [scale] [seqscale] > libc.csv
+ *
+ * dir holds the scratch files (default /tmp) and scale multiplies the
+ *   bytes moved per case (default 1, about 4 MB)
+ * seqscale sizes the sequential read cases the same way (default scale);
+ *   1024 makes them read a 4 GB input file from start to end
+ *
+ * Every entry point runs under _IONBF, _IOLBF and _IOFBF with several
+ *   setvbuf( ) buffer sizes; fread( ) and fwrite( ) also sweep record
+ *   sizes from 1 byte to 16 MB
+ * Each case runs twice: an untimed pass gives the throughput and the
+ *   syscall count, and a second pass times every call for p50 / p99
+ * Syscalls are the read and write calls counted in /proc/self/io, so
+ *   lseek( ) is not included; -1 means the counters are not available
+ * Unbuffered cases stop after 262144 calls to keep the run short
+ * This stdio's printf( ) formats on the stack and has no stream, so only
+ *   the libc printf rows change with the mode
+ * fputs runs on the output file opened "w" and, as fputs_a, opened "a"
+ *   like a log, where every flush must land at the end of the file
+ * The _r and _m rows read the input file sequentially once opened "r"
+ *   and once opened "rm", which maps it, both with fopen( )'s own
+ *   buffering, so they compare refill( ) with reads from the mapping;
+ *   both pass over a file already in the page cache
+ * The _xN rows share one fully buffered stream among N writer threads,
+ *   doubling N from 1 up to the number of CPUs, or 4 on smaller machines,
+ *   where the threads contend by preemption; the total bytes stay the
+ *   same, so flat mb_per_s means the stream lock scales; fputs_batch
+ *   takes the lock once per BENCH_BATCH lines and writes them with
+ *   fputs_unlocked( )
+ * The parse rows read the input file a line at a time, hash and count
+ *   each line and fprintf( ) a formatted record of it to the output file,
+ *   so formatting, parsing and I/O mix; the input buffering is the mode
+ *   under test, and this stdio also runs it with _IORA read-ahead
+ * The write rows call write( ) once per record on the fwrite( ) output
+ *   file, which is what fwrite( ) cost before it buffered; compare their
+ *   syscalls_per_mb with the fwrite rows of the same record size
+ *
+ * Columns:
+ *   impl,op,mode,bufsize,recsize,calls,mb_per_s,p50_ns,p99_ns,syscalls_per_mb
+ */
+
+#ifdef BENCH_LIBC
+#include <stdio.h>
+#define BENCH_IMPL "libc"
+#define BENCH_FD(stream) fileno(stream)
+#else
+#include "../stdio.h"
+#define BENCH_IMPL "stdio"
+#define BENCH_FD(stream) ((stream)->fd)
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BYTES (4L * 1024 * 1024)      // Bytes per case at scale 1
+#define BENCH_NBFCALLS 262144               // Call limit without a buffer
+#define BENCH_SEEKS 100000                  // Calls per fseek( ) case
+#define BENCH_LINE 80                       // fgets( ) / fputs( ) line
+#define BENCH_MAXREC (16L * 1024 * 1024)    // Largest fread( ) record
+#define BENCH_BATCH 16                      // Lines per locked fputs batch
+#define BENCH_MAXTHREADS 64                 // Most writers on one stream
+
+#define BENCH_READ 0                        // Op reads the input file
+#define BENCH_WRITE 1                       // Op writes the output file
+#define BENCH_STDOUT 2                      // Op writes standard output
+#define BENCH_APPEND 3                      // Op appends to the output file
+#define BENCH_MAPPED 4                      // Op reads the mapped input file
+
+// One buffering mode under test
+struct benchmode
+{
+   const char* name;                        // CSV label
+   int mode;                                // _IONBF, _IOLBF or _IOFBF
+   size_t size;                             // setvbuf( ) buffer size
+};
+
+static const benchmode modes[] =
+{
+   { "nbf", _IONBF, 0 },
+   { "lbf", _IOLBF, 8192 },
+   { "fbf", _IOFBF, 4096 },
+   { "fbf", _IOFBF, 8192 },
+   { "fbf", _IOFBF, 65536 },
+   { "fbf", _IOFBF, 1024 * 1024 }
+};
+
+static const benchmode plain =              // No setvbuf( ), which unmaps
+{
+   "default", -1, 0
+};
+
+static const size_t recsizes[] =
+{
+   1, 16, 256, 4096, 65536, 1024 * 1024, 16 * 1024 * 1024
+};
+
+static char inpath[512];                    // File read by the read cases
+static char outpath[512];                   // File written by the others
+static off_t insize;                        // Size of inpath
+static uint64_t seed = 88172645463325252ULL; // fseek( ) offsets
+static char line[BENCH_LINE + 1];           // What fputs( ) writes
+static FILE* sink;                          // Output of the parse rows
+
+// ------------------------------------------------------------------ nownsec()
+// Monotonic time in nanoseconds
+//
+static inline uint64_t nownsec()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} // end nownsec
+
+// ----------------------------------------------------------------- syscalls()
+// Read and write syscalls made by this process so far
+//
+// return: The count, -1 if /proc/self/io cannot be read
+//
+static long long syscalls()
+{
+   char buf[512];
+   int fd = open("/proc/self/io", O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   ssize_t n = read(fd, buf, sizeof(buf) - 1);
+   close(fd);
+   if (n <= 0)
+   {
+      return -1;
+   }
+   buf[n] = '\0';
+
+   const char* r = strstr(buf, "syscr:");
+   const char* w = strstr(buf, "syscw:");
+   if (r == NULL || w == NULL)
+   {
+      return -1;
+   }
+   return atoll(r + 6) + atoll(w + 6);
+} // end syscalls
+
+// -------------------------------------------- cmpns(const void*, const void*)
+// qsort( ) order for latencies
+//
+static int cmpns(const void* a, const void* b)
+{
+   uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+   return (x > y) - (x < y);
+} // end cmpns
+
+// One call under test, returning the bytes it moved
+// The stream is NULL for BENCH_STDOUT ops
+typedef size_t (*benchop)(FILE* stream, char* buf, size_t rec);
+
+static size_t op_fgetc(FILE* stream, char*, size_t)
+{
+   return (fgetc(stream) != EOF) ? 1 : 0;
+}
+
+static size_t op_fputc(FILE* stream, char*, size_t)
+{
+   return (fputc('x', stream) != EOF) ? 1 : 0;
+}
+
+static size_t op_fgets(FILE* stream, char* buf, size_t)
+{
+   return (fgets(buf, BENCH_LINE + 1, stream) != NULL) ? strlen(buf) : 0;
+}
+
+static size_t op_fputs(FILE* stream, char*, size_t)
+{
+   return (fputs(line, stream) >= 0) ? BENCH_LINE : 0;
+}
+
+static size_t op_fread(FILE* stream, char* buf, size_t rec)
+{
+   return fread(buf, 1, rec, stream);
+}
+
+static size_t op_fwrite(FILE* stream, char* buf, size_t rec)
+{
+   return fwrite(buf, 1, rec, stream);
+}
+
+static size_t op_write(FILE* stream, char* buf, size_t rec)
+{
+   ssize_t put = write(BENCH_FD(stream), buf, rec);
+   return (put > 0) ? put : 0;
+}
+
+static size_t op_fputs_batch(FILE* stream, char*, size_t)
+{
+   size_t put = 0;
+   flockfile(stream);
+   for (int i = 0; i < BENCH_BATCH; i++)
+   {
+      put += (fputs_unlocked(line, stream) >= 0) ? BENCH_LINE : 0;
+   }
+   funlockfile(stream);
+   return put;
+}
+
+static size_t op_fseek(FILE* stream, char* buf, size_t rec)
+{
+   seed ^= seed << 13;                      // xorshift64
+   seed ^= seed >> 7;
+   seed ^= seed << 17;
+   fseek(stream, (long)(seed % (uint64_t)(insize - rec)), SEEK_SET);
+   return fread(buf, 1, rec, stream);
+}
+
+static size_t op_fprintf(FILE* stream, char*, size_t)
+{
+   return fprintf(stream, "%d %s %.2f\n", (int)(seed++ & 0xffff), "bench",
+      2.5);
+}
+
+static size_t op_printf(FILE*, char*, size_t)
+{
+   return printf("%d %s %.2f\n", (int)(seed++ & 0xffff), "bench", 2.5);
+}
+
+static size_t op_parse(FILE* stream, char* buf, size_t)
+{
+   if (fgets(buf, BENCH_LINE + 1, stream) == NULL)
+   {
+      return 0;
+   }
+   uint32_t hash = 2166136261u;             // FNV-1a
+   unsigned vowels = 0;
+   size_t len = 0;
+   for (; buf[len] != '\0' && buf[len] != '\n'; len++)
+   {
+      char c = buf[len];
+      hash = (hash ^ (unsigned char)c) * 16777619u;
+      vowels += (c == 'a' || c == 'e' || c == 'i' || c == 'o' || c == 'u');
+   }
+   fprintf(sink, "%5u %08x %-16.16s %6.3f %c %ld\n", vowels, hash, buf,
+      (len > 0) ? (double)vowels / len : 0.0, buf[0], (long)len);
+   return len + 1;
+}
+
+// -------------------------------------- openfor(int, const benchmode*, char*)
+// Opens the input or output file with the buffering under test
+//
+// param: target  BENCH_READ, BENCH_MAPPED, BENCH_WRITE or BENCH_APPEND
+// param: m       Mode and buffer size given to setvbuf( ), mode -1 for none
+// param: userbuf Buffer handed to setvbuf( ), m->size bytes
+//
+static FILE* openfor(int target, const benchmode* m, char* userbuf)
+{
+   FILE* stream;
+   if (target == BENCH_READ || target == BENCH_MAPPED)
+   {
+      stream = fopen(inpath, (target == BENCH_MAPPED) ? "rm" : "r");
+   }
+   else
+   {
+      stream = fopen(outpath, (target == BENCH_APPEND) ? "a" : "w");
+   }
+   if (stream == NULL)
+   {
+      return NULL;
+   }
+   if (m->mode != -1)
+   {
+      setvbuf(stream, (m->mode == _IONBF) ? NULL : userbuf, m->mode,
+         m->size);
+   }
+   return stream;
+} // end openfor
+
+// --------- putrow(const char*, const benchmode*, size_t, size_t, size_t, ...)
+// Writes one CSV row, sorting the latencies for p50 / p99
+//
+// param: name    Op label for the row
+// param: m       Buffering the case ran with
+// param: rec     Bytes asked for per call
+// param: calls   Calls made per pass
+// param: bytes   Bytes moved by the untimed pass
+// param: ns      Duration of the untimed pass
+// param: lat     Per-call latencies of the timed pass, calls of them
+// param: sys     Syscalls made by the untimed pass, -1 when unknown
+//
+static void putrow(const char* name, const benchmode* m, size_t rec,
+   size_t calls, size_t bytes, uint64_t ns, uint32_t* lat, long long sys)
+{
+   qsort(lat, calls, sizeof(uint32_t), cmpns);
+   double mb = bytes / (1024.0 * 1024.0);
+   double secs = ns / 1e9;
+   double perMB = (sys == -1 || mb == 0) ? -1 : sys / mb;
+   char row[256];                           // Not through a stream
+   int len = snprintf(row, sizeof(row), "%s,%s,%s,%zu,%zu,%zu,%.1f,%u,%u,"
+      "%.2f\n", BENCH_IMPL, name, m->name, m->size, rec, calls,
+      (secs > 0) ? mb / secs : 0.0, lat[calls / 2], lat[calls * 99 / 100],
+      perMB);
+   if (len > 0)
+   {
+      write(1, row, len);
+   }
+} // end putrow
+
+// ------- runcase(const char*, benchop, int, const benchmode*, size_t, size_t)
+// Runs one op, mode and record size and writes its CSV row
+// BENCH_STDOUT ops run with standard output sent to /dev/null
+//
+// param: name    Op label for the row
+// param: op      The call under test
+// param: target  BENCH_READ, BENCH_MAPPED, BENCH_WRITE, BENCH_APPEND or
+//                BENCH_STDOUT
+// param: m       Buffering under test
+// param: rec     Bytes asked for per call
+// param: total   Bytes to move, before the _IONBF call limit
+//
+static void runcase(const char* name, benchop op, int target,
+   const benchmode* m, size_t rec, size_t total)
+{
+   bool tostdout = (target == BENCH_STDOUT);
+   size_t calls = total / rec;
+   if (calls == 0)
+   {
+      calls = 1;
+   }
+   if (m->mode == _IONBF && calls > BENCH_NBFCALLS)
+   {
+      calls = BENCH_NBFCALLS;
+   }
+
+   char* buf = (char*)malloc(rec + BENCH_LINE + 1);
+   char* userbuf = (char*)malloc(m->size + 1);
+   uint32_t* lat = (uint32_t*)malloc(calls * sizeof(uint32_t));
+   memset(buf, 'x', rec);
+
+   int saved = -1;
+   if (tostdout)                            // printf( ) output goes nowhere
+   {
+      int null = open("/dev/null", O_WRONLY);
+      saved = dup(1);
+      dup2(null, 1);
+      close(null);
+#ifdef BENCH_LIBC
+      setvbuf(stdout, (m->mode == _IONBF) ? NULL : userbuf, m->mode,
+         m->size);
+#endif
+   }
+
+   size_t bytes = 0;                        // Untimed pass
+   long long sys0 = syscalls();
+   uint64_t t0 = nownsec();
+   FILE* stream = tostdout ? NULL : openfor(target, m, userbuf);
+   for (size_t i = 0; i < calls; i++)
+   {
+      bytes += op(stream, buf, rec);
+   }
+   if (stream != NULL)
+   {
+      fclose(stream);
+   }
+#ifdef BENCH_LIBC
+   if (tostdout)
+   {
+      fflush(stdout);
+   }
+#endif
+   uint64_t t1 = nownsec();
+   long long sys1 = syscalls();
+
+   stream = tostdout ? NULL : openfor(target, m, userbuf); // Timed pass
+   for (size_t i = 0; i < calls; i++)
+   {
+      uint64_t a = nownsec();
+      op(stream, buf, rec);
+      uint64_t d = nownsec() - a;
+      lat[i] = (d > UINT32_MAX) ? UINT32_MAX : (uint32_t)d;
+   }
+   if (stream != NULL)
+   {
+      fclose(stream);
+   }
+
+   if (tostdout)
+   {
+#ifdef BENCH_LIBC
+      fflush(stdout);
+      setvbuf(stdout, NULL, _IOLBF, 0);     // userbuf is about to go
+#endif
+      dup2(saved, 1);
+      close(saved);
+   }
+
+   putrow(name, m, rec, calls, bytes, t1 - t0, lat,
+      (sys0 == -1) ? -1 : sys1 - sys0);
+   free(lat);
+   free(userbuf);
+   free(buf);
+} // end runcase
+
+// ----------------------------------------- runparse(const benchmode*, size_t)
+// Runs the parse rows with the input buffering under test, sending the
+//   formatted records to the output file
+//
+// param: m       Buffering of the input stream
+// param: total   Input bytes to parse
+//
+static void runparse(const benchmode* m, size_t total)
+{
+   sink = fopen(outpath, "w");
+   if (sink == NULL)
+   {
+      return;
+   }
+   runcase("parse", op_parse, BENCH_READ, m, BENCH_LINE, total);
+   fclose(sink);
+} // end runparse
+
+// One writer thread of a contention case
+struct benchthread
+{
+   benchop op;                              // The call under test
+   FILE* stream;                            // Stream shared by all writers
+   size_t rec;                              // Bytes asked for per call
+   size_t calls;                            // Calls this thread makes
+   char* buf;                               // rec bytes to write
+   uint32_t* lat;                           // Latencies, NULL when untimed
+};
+
+// --------------------------------------------------------- writer_main(void*)
+// Contention case thread body: makes its calls on the shared stream
+//
+// param: arg     The thread's benchthread
+//
+static void* writer_main(void* arg)
+{
+   benchthread* t = (benchthread*)arg;
+   for (size_t i = 0; i < t->calls; i++)
+   {
+      if (t->lat == NULL)
+      {
+         t->op(t->stream, t->buf, t->rec);
+         continue;
+      }
+      uint64_t a = nownsec();
+      t->op(t->stream, t->buf, t->rec);
+      uint64_t d = nownsec() - a;
+      t->lat[i] = (d > UINT32_MAX) ? UINT32_MAX : (uint32_t)d;
+   }
+   return NULL;
+} // end writer_main
+
+// ---- runthreads(const char*, benchop, const benchmode*, size_t, size_t, int)
+// Runs one write op from several threads on a single output stream and
+//   writes its CSV row, with the thread count appended to the op label
+//
+// param: name    Op label for the row
+// param: op      The call under test, a writing op
+// param: m       Buffering of the shared stream
+// param: rec     Bytes written per call
+// param: total   Bytes to write across all threads
+// param: nthreads Writer threads, at most BENCH_MAXTHREADS
+//
+static void runthreads(const char* name, benchop op, const benchmode* m,
+   size_t rec, size_t total, int nthreads)
+{
+   size_t each = total / rec / nthreads;    // Calls per thread
+   if (each == 0)
+   {
+      each = 1;
+   }
+   size_t calls = each * nthreads;
+
+   char* buf = (char*)malloc(rec);
+   char* userbuf = (char*)malloc(m->size + 1);
+   uint32_t* lat = (uint32_t*)malloc(calls * sizeof(uint32_t));
+   memset(buf, 'x', rec);
+   benchthread t[BENCH_MAXTHREADS];
+   pthread_t tid[BENCH_MAXTHREADS];
+
+   uint64_t t0 = 0, t1 = 0;
+   long long sys0 = 0, sys1 = 0;
+   for (int timed = 0; timed < 2; timed++)  // Untimed pass, then timed
+   {
+      if (!timed)
+      {
+         sys0 = syscalls();
+         t0 = nownsec();
+      }
+      FILE* stream = openfor(BENCH_WRITE, m, userbuf);
+      for (int i = 0; i < nthreads; i++)
+      {
+         t[i].op = op;
+         t[i].stream = stream;
+         t[i].rec = rec;
+         t[i].calls = each;
+         t[i].buf = buf;
+         t[i].lat = timed ? lat + i * each : NULL;
+         pthread_create(&tid[i], NULL, writer_main, &t[i]);
+      }
+      for (int i = 0; i < nthreads; i++)
+      {
+         pthread_join(tid[i], NULL);
+      }
+      fclose(stream);
+      if (!timed)
+      {
+         t1 = nownsec();
+         sys1 = syscalls();
+      }
+   }
+
+   char label[64];
+   snprintf(label, sizeof(label), "%s_x%d", name, nthreads);
+   putrow(label, m, rec, calls, calls * rec, t1 - t0, lat,
+      (sys0 == -1) ? -1 : sys1 - sys0);
+   free(lat);
+   free(userbuf);
+   free(buf);
+} // end runthreads
+
+// ----------------------------------------------------------- makeinput(off_t)
+// Writes the input file as lines of BENCH_LINE bytes with plain write( )s
+//
+// return: 0 on success, -1 on error
+//
+static int makeinput(off_t size)
+{
+   int fd = open(inpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   char* chunk = (char*)malloc(1024 * 1024);
+   for (size_t i = 0; i < 1024 * 1024; i++)
+   {
+      chunk[i] = ((i + 1) % BENCH_LINE == 0) ? '\n' : 'a' + i % 26;
+   }
+   for (off_t done = 0; done < size; done += 1024 * 1024)
+   {
+      if (write(fd, chunk, 1024 * 1024) != 1024 * 1024)
+      {
+         free(chunk);
+         close(fd);
+         return -1;
+      }
+   }
+   free(chunk);
+   close(fd);
+   insize = size;
+   return 0;
+} // end makeinput
+
+int main(int argc, char** argv)
+{
+   const char* dir = (argc > 1) ? argv[1] : "/tmp";
+   long scale = (argc > 2) ? atol(argv[2]) : 1;
+   if (scale < 1)
+   {
+      scale = 1;
+   }
+   long seqscale = (argc > 3) ? atol(argv[3]) : scale;
+   if (seqscale < 1)
+   {
+      seqscale = 1;
+   }
+   long total = BENCH_BYTES * scale;        // Bytes per case
+   long seqtotal = BENCH_BYTES * seqscale;  // Bytes per sequential read
+
+   snprintf(inpath, sizeof(inpath), "%s/bench_in.%d", dir, (int)getpid());
+   snprintf(outpath, sizeof(outpath), "%s/bench_out.%d", dir, (int)getpid());
+   memset(line, 'y', BENCH_LINE - 1);
+   line[BENCH_LINE - 1] = '\n';
+
+   off_t need = (total > 4 * BENCH_MAXREC) ? total : 4 * BENCH_MAXREC;
+   need = (seqtotal > need) ? seqtotal : need;
+   need = (need + 1024 * 1024 - 1) / (1024 * 1024) * (1024 * 1024);
+   if (makeinput(need) == -1)
+   {
+      const char msg[] = "cannot write the input file\n";
+      write(2, msg, sizeof(msg) - 1);
+      return 1;
+   }
+
+   const char header[] = "impl,op,mode,bufsize,recsize,calls,mb_per_s,"
+      "p50_ns,p99_ns,syscalls_per_mb\n";
+   write(1, header, sizeof(header) - 1);
+
+   int nmodes = sizeof(modes) / sizeof(modes[0]);
+   int nrecs = sizeof(recsizes) / sizeof(recsizes[0]);
+   for (int i = 0; i < nmodes; i++)
+   {
+      const benchmode* m = &modes[i];
+      runcase("fgetc", op_fgetc, BENCH_READ, m, 1, total);
+      runcase("fputc", op_fputc, BENCH_WRITE, m, 1, total);
+      runcase("fgets", op_fgets, BENCH_READ, m, BENCH_LINE, total);
+      runcase("fputs", op_fputs, BENCH_WRITE, m, BENCH_LINE, total);
+      unlink(outpath);                      // Appends start from empty
+      runcase("fputs_a", op_fputs, BENCH_APPEND, m, BENCH_LINE, total);
+      for (int r = 0; r < nrecs; r++)
+      {
+         long bytes = (total > 4 * (long)recsizes[r]) ? total
+            : 4 * (long)recsizes[r];
+         runcase("fread", op_fread, BENCH_READ, m, recsizes[r], bytes);
+         runcase("fwrite", op_fwrite, BENCH_WRITE, m, recsizes[r], bytes);
+      }
+      runcase("fseek", op_fseek, BENCH_READ, m, 256,
+         (size_t)BENCH_SEEKS * 256);
+      runcase("fprintf", op_fprintf, BENCH_WRITE, m, 16, total);
+      runcase("printf", op_printf, BENCH_STDOUT, m, 16, total);
+   }
+   static const size_t seqrecs[] = { 4096, 65536, 1024 * 1024 };
+   for (int mapped = 0; mapped < 2; mapped++) // Refill( ) against mmap( )
+   {
+      int target = mapped ? BENCH_MAPPED : BENCH_READ;
+      for (int r = 0; r < 3; r++)
+      {
+         runcase(mapped ? "fread_m" : "fread_r", op_fread, target, &plain,
+            seqrecs[r], seqtotal);
+      }
+      runcase(mapped ? "fgets_m" : "fgets_r", op_fgets, target, &plain,
+         BENCH_LINE, seqtotal);
+   }
+   runparse(&plain, total);                 // Mixed parsing and I/O
+   runparse(&modes[4], total);
+#ifndef BENCH_LIBC
+   static const benchmode ra = { "ra", _IORA, 65536 };
+   runparse(&ra, total);
+#endif
+
+   int ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   ncpus = (ncpus < 4) ? 4 : (ncpus > BENCH_MAXTHREADS) ? BENCH_MAXTHREADS
+      : ncpus;
+   for (int n = 1; ; n = (n * 2 < ncpus) ? n * 2 : ncpus) // Writer threads
+   {
+      runthreads("fwrite", op_fwrite, &modes[4], 64, total, n);
+      runthreads("fputs", op_fputs, &modes[4], BENCH_LINE, total, n);
+      runthreads("fputs_batch", op_fputs_batch, &modes[4],
+         BENCH_BATCH * BENCH_LINE, total, n);
+      if (n == ncpus)
+      {
+         break;
+      }
+   }
+   for (int r = 0; r < nrecs; r++)          // Unbuffered fwrite( ) baseline
+   {
+      long bytes = (total > 4 * (long)recsizes[r]) ? total
+         : 4 * (long)recsizes[r];
+      runcase("write", op_write, BENCH_WRITE, &modes[0], recsizes[r], bytes);
+   }
+
+   unlink(inpath);
+   unlink(outpath);
+   return 0;
+}
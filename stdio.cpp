@@ -20,819 +20,6543 @@
  * A user calling fpurge() does so knowing all the content
  *   in the buffer will be overwritten with \0
  * fseek() sets EOF when applicable
+ * Memory-mapped streams (mode modifier 'm') hold the whole file in
+ *   their buffer, so EOF is set as soon as they are opened
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <new>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
-char decimal[100];
+int fmap(FILE* stream);
+void adapt_open(FILE* stream);
+void funmap(FILE* stream);
+void ra_stop(FILE* stream);
+void dsync_note(FILE* stream, size_t n);
+bool lz_allows(FILE* stream, int mode, size_t size);
+void lz_start(FILE* stream);
+void lz_stop(FILE* stream);
+int lz_flush(FILE* stream);
+void lz_refill(FILE* stream);
+int lz_index(FILE* stream, off_t target);
+int lz_seek(FILE* stream, off_t target);
+bool dio_allows(FILE* stream, char* buf, int mode, size_t size);
+const char* scanchr(const char* p, size_t n, char c);
+const char* scanrchr(const char* p, size_t n, char c);
+ssize_t writeall(int fd, const char* buf, size_t len);
+void flushall_setup();
+int fflushall();
+int setflushdelay(int msec);
 
 /////////////////////////////////////////////////
-// Untouched methods provided by Prof. Dimpsey //
+// Formatted output engine                     //
 /////////////////////////////////////////////////
 
-int recursive_itoa(int arg)
+// Destination for formatted output
+// Bytes are placed in buf until it is full, then spill() drains it
+struct fmtsink
 {
-   int div = arg / 10;
-   int mod = arg % 10;
-   int index = 0;
-   if (div > 0)
-   {
-      index = recursive_itoa(div);
-   }
-   decimal[index] = mod + '0';
-   return ++index;
-}
+   char* buf;                       // Where formatted bytes are placed
+   size_t cap;                      // Capacity of buf
+   size_t len;                      // Bytes currently held in buf
+   size_t total;                    // Bytes produced so far
+   void (*spill)(fmtsink* out);     // Empties buf, may leave it full
+   FILE* stream;                    // Target of fprintf( ), else NULL
+};
 
-char* itoa(const int arg)
-{
-   bzero(decimal, 100);
-   int order = recursive_itoa(arg);
-   char* new_decimal = new char[order + 1];
-   bcopy(decimal, new_decimal, order + 1);
-   return new_decimal;
-}
+// Two ASCII digits for every value 0-99, so integers convert two
+//   digits per division
+static const char digitpairs[201] =
+   "00010203040506070809"
+   "10111213141516171819"
+   "20212223242526272829"
+   "30313233343536373839"
+   "40414243444546474849"
+   "50515253545556575859"
+   "60616263646566676869"
+   "70717273747576777879"
+   "80818283848586878889"
+   "90919293949596979899";
 
-int printf(const void* format, ...)
+// Powers of ten that fit in 64 bits, for %f fractions
+static const uint64_t pow10s[19] =
 {
-   va_list list;
-   va_start(list, format);
+   1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+   10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+   100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+   100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+   100000000000000000ULL, 1000000000000000000ULL
+};
 
-   char* msg = (char*)format;
-   char buf[1024];
-   int nWritten = 0;
+// -------------------------------------- fmtput(fmtsink*, const char*, size_t)
+// Appends bytes to a sink, spilling it each time it fills
+// Bytes that still do not fit after a spill are counted but dropped
+//
+// param: out     Sink receiving the bytes
+// param: src     Bytes to append
+// param: n       Number of bytes to append
+//
+void fmtput(fmtsink* out, const char* src, size_t n)
+{
+   out->total += n;
 
-   int i = 0, j = 0, k = 0;
-   while (msg[i] != '\0')
+   while (n > 0)
    {
-      if (msg[i] == '%' && msg[i + 1] == 'd')
+      if (out->len == out->cap)              // Sink is full
       {
-         buf[j] = '\0';
-         nWritten += write(1, buf, j);
-         j = 0;
-         i += 2;
-
-         int int_val = va_arg(list, int);
-         char* dec = itoa(abs(int_val));
-         if (int_val < 0)
+         out->spill(out);
+         if (out->len == out->cap)           // Nowhere to put the rest
          {
-            nWritten += write(1, "-", 1);
+            return;
          }
-         nWritten += write(1, dec, strlen(dec));
-         delete dec;
       }
-      else
+
+      size_t chunk = out->cap - out->len;
+      if (chunk > n)
       {
-         buf[j++] = msg[i++];
+         chunk = n;
       }
+      memcpy(out->buf + out->len, src, chunk);
+      out->len += chunk;
+      src += chunk;
+      n -= chunk;
    }
-   if (j > 0)
+} // end fmtput
+
+// ----------------------------------------------- fmtfill(fmtsink*, char, int)
+// Appends a run of one repeated byte to a sink, used for padding
+//
+// param: out     Sink receiving the bytes
+// param: c       Byte to repeat
+// param: n       Number of copies, nothing happens if n <= 0
+//
+void fmtfill(fmtsink* out, char c, int n)
+{
+   char run[32];                             // Pad in 32-byte pieces
+
+   memset(run, c, (n < 32) ? ((n > 0) ? n : 0) : 32);
+   while (n > 0)
    {
-      nWritten += write(1, buf, j);
+      int chunk = (n < 32) ? n : 32;
+      fmtput(out, run, chunk);
+      n -= chunk;
    }
-   va_end(list);
-   return nWritten;
-}
+} // end fmtfill
 
-int setvbuf(FILE* stream, char* buf, int mode, size_t size)
+// ---------------------------------------- fmtuint(char*, uint64_t, int, bool)
+// Converts an unsigned value to text, writing backwards from end
+// Decimal values use digitpairs to produce two digits per division
+//
+// param: end     One past the last byte of the output space
+// param: v       Value to convert
+// param: base    8, 10 or 16
+// param: upper   Use upper-case hex digits
+//
+// return: Pointer to the first digit written
+//
+char* fmtuint(char* end, uint64_t v, int base, bool upper)
 {
-   if (mode != _IONBF && mode != _IOLBF && mode != _IOFBF)
+   char* p = end;
+
+   if (base == 10)
    {
-      return -1;
+      while (v >= 100)
+      {
+         unsigned i = (v % 100) * 2;
+         v /= 100;
+         *--p = digitpairs[i + 1];
+         *--p = digitpairs[i];
+      }
+      if (v >= 10)
+      {
+         unsigned i = v * 2;
+         *--p = digitpairs[i + 1];
+         *--p = digitpairs[i];
+      }
+      else
+      {
+         *--p = '0' + v;
+      }
+      return p;
    }
-   stream->mode = mode;
-   stream->pos = 0;
-   if (stream->buffer != (char*)0 && stream->bufown == true)
+
+   const char* hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+   int shift = (base == 16) ? 4 : 3;
+   do
+   {
+      *--p = hex[v & (base - 1)];
+      v >>= shift;
+   } while (v != 0);
+   return p;
+} // end fmtuint
+
+// ---------------------------------------------- fmtdouble(char*, double, int)
+// Converts a non-negative finite double to fixed-point text, writing
+//   backwards from end
+// Up to 18 fraction digits are exact in 64-bit math, the rest are '0'
+//
+// param: end     One past the last byte of the output space
+// param: v       Value to convert
+// param: prec    Digits after the decimal point
+// param: alt     Keep the '.' even when prec is 0
+//
+// return: Pointer to the first character written
+//
+char* fmtdouble(char* end, double v, int prec, bool alt)
+{
+   char* p = end;
+   int exact = (prec > 18) ? 18 : prec;      // Digits computed exactly
+   uint64_t scale = pow10s[exact];
+
+   double ipart = floor(v);
+   long double scaled = (long double)(v - ipart) * scale; // Extra precision
+   uint64_t frac = (uint64_t)scaled;
+   long double rem = scaled - frac;          // Part being rounded away
+   bool odd = (exact > 0) ? (frac & 1) : (fmod(ipart, 2) != 0);
+   if (rem > 0.5 || (rem == 0.5 && odd))     // Round half to even
+   {
+      frac++;
+   }
+   if (frac >= scale)                        // Rounding carried over
    {
-      delete stream->buffer;
+      frac -= scale;
+      ipart += 1;
    }
 
-   switch (mode)
+   for (int i = exact; i < prec; i++)        // Digits past 64-bit range
    {
-   case _IONBF:
-      stream->buffer = (char*)0;
-      stream->size = 0;
-      stream->bufown = false;
-      break;
-   case _IOLBF:
-   case _IOFBF:
-      if (buf != (char*)0)
+      *--p = '0';
+   }
+   if (exact > 0)
+   {
+      char* digits = fmtuint(p, frac, 10, false);
+      while (p - digits < exact)             // Leading fraction zeros
       {
-         stream->buffer = buf;
-         stream->size = size;
-         stream->bufown = false;
+         *--digits = '0';
       }
-      else
+      p = digits;
+   }
+   if (prec > 0 || alt)
+   {
+      *--p = '.';
+   }
+
+   if (ipart < 18446744073709551615.0)       // Integer part fits 64 bits
+   {
+      p = fmtuint(p, (uint64_t)ipart, 10, false);
+   }
+   else
+   {
+      while (ipart >= 1)                     // One digit at a time
       {
-         stream->buffer = new char[BUFSIZ];
-         stream->size = BUFSIZ;
-         stream->bufown = true;
+         *--p = '0' + (int)fmod(ipart, 10);
+         ipart = floor(ipart / 10);
       }
-      break;
    }
-   return 0;
-}
+   return p;
+} // end fmtdouble
 
-void setbuf(FILE* stream, char* buf)
+// ------------------------------------ vformat(fmtsink*, const char*, va_list)
+// Formats a printf-style string into a sink in a single pass
+// Literal text between conversions is copied as one run, and nothing is
+//   allocated
+// Supports the flags - 0 + space #, field width and precision (either
+//   may be *), the length modifiers hh h l ll z, and the conversions
+//   d i u x X o p c s f F %
+// Any other conversion and the rest of the format are copied as written,
+//   since the type of its argument, and of every later one, is unknown
+//
+// param: out     Sink receiving the output
+// param: format  Format string
+// param: list    Arguments for the conversions
+//
+// return: Number of bytes produced
+//
+int vformat(fmtsink* out, const char* format, va_list list)
 {
-   setvbuf(stream, buf, (buf != (char*)0) ? _IOFBF : _IONBF, BUFSIZ);
-}
+   const char* msg = format;                 // Current format position
+   char tmp[400];                            // Converted value, built backwards
+   char* end = tmp + sizeof(tmp);
 
-FILE* fopen(const char* path, const char* mode)
-{
-   FILE* stream = new FILE();
-   setvbuf(stream, (char*)0, _IOFBF, BUFSIZ);
+   while (*msg != '\0')
+   {
+      const char* pct = scanchr(msg, strlen(msg), '%');
+      if (pct == NULL)                       // Literal text to the end
+      {
+         fmtput(out, msg, strlen(msg));
+         break;
+      }
+      if (pct > msg)                         // Literal run before the %
+      {
+         fmtput(out, msg, pct - msg);
+      }
+      msg = pct + 1;
 
-   // fopen( ) mode
-   // r or rb = O_RDONLY
-   // w or wb = O_WRONLY | O_CREAT | O_TRUNC
-   // a or ab = O_WRONLY | O_CREAT | O_APPEND
-   // r+ or rb+ or r+b = O_RDWR
-   // w+ or wb+ or w+b = O_RDWR | O_CREAT | O_TRUNC
-   // a+ or ab+ or a+b = O_RDWR | O_CREAT | O_APPEND
+      bool left = false, zero = false, plus = false, space = false;
+      bool alt = false;
+      for (;; msg++)                         // Flags
+      {
+         if (*msg == '-') left = true;
+         else if (*msg == '0') zero = true;
+         else if (*msg == '+') plus = true;
+         else if (*msg == ' ') space = true;
+         else if (*msg == '#') alt = true;
+         else break;
+      }
 
-   switch (mode[0])
-   {
-   case 'r':
-      if (mode[1] == '\0')  // r
+      int width = 0;                         // Field width
+      if (*msg == '*')
+      {
+         width = va_arg(list, int);
+         if (width < 0)
+         {
+            left = true;
+            width = -width;
+         }
+         msg++;
+      }
+      while (*msg >= '0' && *msg <= '9')
       {
-         stream->flag = O_RDONLY;
+         width = width * 10 + (*msg++ - '0');
       }
-      else if (mode[1] == 'b')
+
+      int prec = -1;                         // Precision, -1 if none
+      if (*msg == '.')
       {
-         if (mode[2] == '\0')  // rb
+         msg++;
+         prec = 0;
+         if (*msg == '*')
          {
-            stream->flag = O_RDONLY;
+            prec = va_arg(list, int);
+            msg++;
          }
-         else if (mode[2] == '+')  // rb+
+         while (*msg >= '0' && *msg <= '9')
          {
-            stream->flag = O_RDWR;
+            prec = prec * 10 + (*msg++ - '0');
          }
       }
-      else if (mode[1] == '+')  // r+  r+b
+
+      int lng = 0;                           // 1 = l or z, 2 = ll, -1 = h,
+      while (*msg == 'h' || *msg == 'l' || *msg == 'z') // -2 = hh
       {
-         stream->flag = O_RDWR;
+         if (*msg == 'l') lng++;
+         else if (*msg == 'z') lng = 1;
+         else lng = (lng == -1) ? -2 : -1;
+         msg++;
       }
-      break;
 
-   case 'w':
-      if (mode[1] == '\0')  // w
+      const char* prefix = "";               // Sign or 0x before the digits
+      char* body = end;                      // Start of the converted text
+      int zeros = 0;                         // Zeros between prefix and body
+      char c = *msg;
+      if (c == '\0')                         // Lone % at the end
+      {
+         fmtput(out, "%", 1);
+         break;
+      }
+      msg++;
+
+      switch (c)
+      {
+      case 'd':
+      case 'i':
       {
-         stream->flag = O_WRONLY | O_CREAT | O_TRUNC;
+         long long v;
+         if (lng >= 2) v = va_arg(list, long long);
+         else if (lng == 1) v = va_arg(list, long);
+         else v = va_arg(list, int);
+         if (lng == -1) v = (short)v;        // Promoted, so narrow again
+         else if (lng == -2) v = (signed char)v;
+
+         uint64_t mag = (v < 0) ? 0 - (uint64_t)v : (uint64_t)v;
+         prefix = (v < 0) ? "-" : plus ? "+" : space ? " " : "";
+         if (!(prec == 0 && mag == 0))
+         {
+            body = fmtuint(end, mag, 10, false);
+         }
+         break;
       }
-      else if (mode[1] == 'b')
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
       {
-         if (mode[2] == '\0')  // wb
+         unsigned long long v;
+         if (lng >= 2) v = va_arg(list, unsigned long long);
+         else if (lng == 1) v = va_arg(list, unsigned long);
+         else v = va_arg(list, unsigned int);
+         if (lng == -1) v = (unsigned short)v;
+         else if (lng == -2) v = (unsigned char)v;
+
+         int base = (c == 'u') ? 10 : (c == 'o') ? 8 : 16;
+         if (!(prec == 0 && v == 0))
          {
-            stream->flag = O_WRONLY | O_CREAT | O_TRUNC;
+            body = fmtuint(end, v, base, c == 'X');
          }
-         else if (mode[2] == '+')  // wb+
+         if (alt && v != 0)
          {
-            stream->flag = O_RDWR | O_CREAT | O_TRUNC;
+            prefix = (c == 'x') ? "0x" : (c == 'X') ? "0X"
+               : (c == 'o') ? "0" : "";
          }
+         break;
       }
-      else if (mode[1] == '+')  // w+  w+b
+      case 'p':
       {
-         stream->flag = O_RDWR | O_CREAT | O_TRUNC;
+         uintptr_t v = (uintptr_t)va_arg(list, void*);
+         body = fmtuint(end, v, 16, false);
+         prefix = "0x";
+         break;
       }
-      break;
-
-   case 'a':
-      if (mode[1] == '\0')  // a
+      case 'c':
+         *--body = (char)va_arg(list, int);
+         prec = -1;
+         break;
+      case 's':
       {
-         stream->flag = O_WRONLY | O_CREAT | O_APPEND;
+         const char* str = va_arg(list, const char*);
+         if (str == NULL)
+         {
+            str = "(null)";
+         }
+         size_t n = (prec >= 0) ? strnlen(str, prec) : strlen(str);
+         int pad = width - (int)n;
+         if (!left)
+         {
+            fmtfill(out, ' ', pad);
+         }
+         fmtput(out, str, n);
+         if (left)
+         {
+            fmtfill(out, ' ', pad);
+         }
+         continue;
       }
-      else if (mode[1] == 'b')
+      case 'f':
+      case 'F':
       {
-         if (mode[2] == '\0')  // ab
+         double v = va_arg(list, double);
+         bool neg = (v < 0);
+         if (neg)
+         {
+            v = -v;
+         }
+         prefix = neg ? "-" : plus ? "+" : space ? " " : "";
+
+         if (v != v)                         // NaN
+         {
+            body = end - 3;
+            memcpy(body, (c == 'F') ? "NAN" : "nan", 3);
+            zero = false;
+         }
+         else if (v > 1.7976931348623157e308) // Infinity
          {
-            stream->flag = O_WRONLY | O_CREAT | O_APPEND;
+            body = end - 3;
+            memcpy(body, (c == 'F') ? "INF" : "inf", 3);
+            zero = false;
          }
-         else if (mode[2] == '+')  // ab+
+         else
          {
-            stream->flag = O_RDWR | O_CREAT | O_APPEND;
+            if (prec < 0)
+            {
+               prec = 6;
+            }
+            else if (prec > 64)
+            {
+               prec = 64;
+            }
+            body = fmtdouble(end, v, prec, alt);
          }
+         prec = -1;
+         break;
       }
-      else if (mode[1] == '+')  // a+  a+b
-      {
-         stream->flag = O_RDWR | O_CREAT | O_APPEND;
+      case '%':
+         fmtput(out, "%", 1);
+         continue;
+      default:                               // Unknown, stop here
+         fmtput(out, pct, strlen(pct));
+         return out->total;
       }
-      break;
-   }
 
-   mode_t open_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+      int blen = end - body;                 // Length of the converted text
+      if (prec > blen)                       // Integer precision
+      {
+         zeros = prec - blen;
+      }
+      int plen = strlen(prefix);
+      int pad = width - plen - zeros - blen;
 
-   if ((stream->fd = open(path, stream->flag, open_mode)) == -1)
-   {
-      delete stream;
-      printf("fopen failed\n");
-      stream = NULL;
+      if (zero && !left && prec < 0 && pad > 0) // Zero fill after the sign
+      {
+         zeros += pad;
+         pad = 0;
+      }
+      if (!left)
+      {
+         fmtfill(out, ' ', pad);
+      }
+      fmtput(out, prefix, plen);
+      fmtfill(out, '0', zeros);
+      fmtput(out, body, blen);
+      if (left)
+      {
+         fmtfill(out, ' ', pad);
+      }
    }
 
-   return stream;
-}
+   return out->total;
+} // end vformat
 
-///////////////////////////////////////
-// Methods written by Korosh Moosavi //
-///////////////////////////////////////
+// ---------------------------------------------------------- spillfd(fmtsink*)
+// Drains a printf( ) sink to standard output
+//
+void spillfd(fmtsink* out)
+{
+   writeall(1, out->buf, out->len);
+   out->len = 0;
+} // end spillfd
 
-// -------------------------------------------------------------- fpurge(FILE*)
-// This method wipes the data in the file buffer by replacing every element
-//   with '\0'
-// The file buffer's position and actual size are reset to 0
-// 
-// param: stream  Pointer to the file object whose buffer is being cleared
-// 
-// pre:    The file has been initialized an opened
-// post:   File buffer is refilled with \0, actual size & position are reset
-// return: 0 on success, -1 on error
+// -------------------------------------------------------- spillnone(fmtsink*)
+// Leaves an snprintf( ) sink full so the excess output is dropped
 //
-int fpurge(FILE* stream)
+void spillnone(fmtsink*)
 {
-   if (stream == nullptr)                    // Parameter validation
-   {
-      printf("Null file parameter");
-      return -1;
-   }
-   if (stream->mode == _IONBF)               // No-buffer check
+} // end spillnone
+
+// --------------------------------------------------- printf(const void*, ...)
+// Formats into a stack buffer and writes it to standard output, so a
+//   call costs one write( ) unless the output exceeds the buffer
+//
+// param: format  Format string, see vformat( )
+//
+// return: Number of bytes written
+//
+int printf(const void* format, ...)
+{
+   va_list list;
+   va_start(list, format);
+
+   char buf[1024];                           // Output staged on the stack
+   fmtsink out = { buf, sizeof(buf), 0, 0, spillfd, NULL };
+
+   int nWritten = vformat(&out, (const char*)format, list);
+   if (out.len > 0)
    {
-      return -1;
+      spillfd(&out);
    }
+   va_end(list);
+   return nWritten;
+} // end printf
 
-   stream->fpos -= stream->actual_size - stream->pos;
-   lseek(stream->fd, 0, stream->fpos);       // Backtrack if buffer is unused
+// ---------------------------------- snprintf(char*, size_t, const char*, ...)
+// Formats into a user buffer, truncating to size - 1 bytes plus '\0'
+//
+// param: str     User buffer
+// param: size    Size of the user buffer
+// param: format  Format string, see vformat( )
+//
+// return: Length the full output would have had
+//
+int snprintf(char* str, size_t size, const char* format, ...)
+{
+   va_list list;
+   va_start(list, format);
 
-   for (int i = 0; i < stream->size; i++)    // Loop through every element
+   fmtsink out = { str, (size > 0) ? size - 1 : 0, 0, 0, spillnone, NULL };
+   int nWritten = vformat(&out, format, list);
+   if (size > 0)
    {
-      stream->buffer[i] = '\0';              // Replace with '\0'
+      str[out.len] = '\0';                   // Terminate even if truncated
    }
+   va_end(list);
+   return nWritten;
+} // end snprintf
 
-   stream->pos = 0;                          // Reset position & actual size
-   stream->actual_size = 0;
-   stream->lastop = 0;
-   return 0;
-} // end fpurge
+/////////////////////////////////////////////////
+// Stream locking                              //
+/////////////////////////////////////////////////
 
-// -------------------------------------------------------------- fflush(FILE*)
-// This method prints what remains in the buffer to the file
-// Buffer is then purged
-// 
-// param: stream  Pointer to the file object whose buffer is being flushed
-// 
-// pre:    The file has been initialized an opened
-// post:   Remaining file buffer is written and purged
-// return: 0 on success, -1 on error
+// ----------------------------------------------------------- flockfile(FILE*)
+// Takes the stream's lock, waiting if another thread holds it
+// The lock is recursive, so a thread may take it again while holding it
+// Every stream function locks around its _unlocked variant, so hot loops
+//   can hold the lock once and call the _unlocked variants directly
 //
-int fflush(FILE* stream)
+// param: stream  Pointer to the file object being locked
+//
+void flockfile(FILE* stream)
 {
-   if (stream == nullptr)                    // Parameter validation
+   if (stream != nullptr)
    {
-      printf("Null file parameter");
-      return -1;
+      pthread_mutex_lock(&stream->lock);
    }
-   if (stream->lastop == 'w')                // Set actual size to correct val
+} // end flockfile
+
+// -------------------------------------------------------- ftrylockfile(FILE*)
+// Takes the stream's lock only if that can be done without waiting
+//
+// param: stream  Pointer to the file object being locked
+//
+// return: 0 if the lock was taken, nonzero otherwise
+//
+int ftrylockfile(FILE* stream)
+{
+   if (stream == nullptr)
    {
-      stream->actual_size = stream->pos;
+      return -1;
    }
-   if (stream->mode == _IONBF)               // No-buffer check
+   return pthread_mutex_trylock(&stream->lock);
+} // end ftrylockfile
+
+// --------------------------------------------------------- funlockfile(FILE*)
+// Releases one hold of the stream's lock
+//
+// param: stream  Pointer to the file object being unlocked
+//
+void funlockfile(FILE* stream)
+{
+   if (stream != nullptr)
    {
-      return -1;
+      pthread_mutex_unlock(&stream->lock);
    }
+} // end funlockfile
 
-   write(stream->fd, stream->buffer, stream->actual_size);
-   stream->fpos += stream->actual_size;
+/////////////////////////////////////////////////
+// I/O accounting                              //
+/////////////////////////////////////////////////
 
-   fpurge(stream);
-   return 0;
-} // end fflush
+// Every system call made on a stream's descriptor goes through the io_
+//   wrappers below, which count it in the stream's fstats when the
+//   library is built with STDIO_STATS
+// Without STDIO_STATS the wrappers are plain inline calls and the
+//   counters do not exist
+#ifdef STDIO_STATS
+#define STAT_ADD(stream, field, n) ((stream)->stats.field += (n))
+#else
+#define STAT_ADD(stream, field, n) ((void)0)
+#endif
 
-// -------------------------------------------------------------- refill(FILE*)
-// Reads from the file and fills the buffer
-// Sets file's EOF field to true if amount read is less than full buffer
-// Used by read methods when buffer is empty or fully used
-// 
-// param: stream  Pointer to the file object whose buffer is being refilled
-// 
-// pre:    The file has been initialized an opened
-// post:   File buffer is refilled if data remains in the file
-//         EOF is set to true if amount read is less than buffer size
+static FILE* openstreams = NULL;            // Every open stream
+static pthread_mutex_t streamlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t streamonce = PTHREAD_ONCE_INIT;
+
+#ifdef STDIO_STATS
+// -------------------------------------------------------------- stat_clock( )
+// Returns a monotonic timestamp in nanoseconds for syscall timing
 //
-void refill(FILE* stream)
+uint64_t stat_clock()
 {
-   if (stream == nullptr)                    // Parameter validation
-   {
-      printf("Null file parameter");
-      return;
-   }
-   if (stream->mode == _IONBF)               // No-buffer check
-   {
-      return;
-   }
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} // end stat_clock
+#endif
 
-   stream->pos = 0;
-   stream->actual_size = read(stream->fd, stream->buffer, stream->size);
-   if (stream->actual_size == -1)
-   {
-      printf("Error in reading file\n");     // read() returns -1 on error
-      return;
-   }
-   if (stream->actual_size < stream->size)
-   {
-      stream->eof = true;                    // Set EOF if needed
-   }
-   return;
-} // end refill
+// ---------------------------------------------- io_read(FILE*, void*, size_t)
+// read( ) on the stream's descriptor
+//
+inline ssize_t io_read(FILE* stream, void* buf, size_t n)
+{
+#ifdef STDIO_STATS
+   uint64_t start = stat_clock();
+   ssize_t got = read(stream->fd, buf, n);
+   stream->stats.syscall_ns += stat_clock() - start;
+   stream->stats.reads++;
+   stream->stats.bytes_read += (got > 0) ? got : 0;
+   return got;
+#else
+   return read(stream->fd, buf, n);
+#endif
+} // end io_read
 
-// ---------------------------------------- fread(void*, size_t, size_t, FILE*)
-// Outputs a given amount of memory from the file buffer to the user buffer
-// Reads from the file directly if memory requested is multiple times 
-//   the max file buffer size
-// 
-// param: ptr     Pointer to an index in the user buffer
-// param: size    Byte size of one unit in the user buffer
-// param: nmemb   Number of units to read
-// param: stream  Pointer to the file object being read from
-// 
-// pre:    The file has been initialized an opened
-// post:   Requested amount of memory is read from the file to the user
-//           buffer, up to the end of the file
-//         EOF is set to true if amount read is less than buffer size
+// -------------------------------------- io_pread(FILE*, void*, size_t, off_t)
+// pread( ) on the stream's descriptor
+// fpread( ) calls it without the stream lock, so it counts atomically
 //
-size_t fread(void* ptr, size_t size, size_t nmemb, FILE* stream)
+inline ssize_t io_pread(FILE* stream, void* buf, size_t n, off_t off)
 {
-   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
-      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))
-   {
-      printf("Read permissions not granted\n"); // Permissions check
-      return -1;
-   }
-   if (stream == nullptr)                       // Parameter validation
-   {
-      printf("Null file parameter");
-      return -1;
-   }
-   if (size < 1 || nmemb < 1)                   // Parameter validation
-   {
-      printf("nmemb must be > 0\n");
-      return -1;
-   }
-   if ((stream->pos == stream->actual_size &&
-      (stream->actual_size > 0 || stream->pos > 0))
-      || stream->lastop == 0)                   // Buffer empty or used up
+#ifdef STDIO_STATS
+   uint64_t start = stat_clock();
+   ssize_t got = pread(stream->fd, buf, n, off);
+   __atomic_add_fetch(&stream->stats.syscall_ns, stat_clock() - start,
+      __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stream->stats.reads, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stream->stats.bytes_read, (got > 0) ? got : 0,
+      __ATOMIC_RELAXED);
+   return got;
+#else
+   return pread(stream->fd, buf, n, off);
+#endif
+} // end io_pread
+
+// ------------------------------- io_pwrite(FILE*, const void*, size_t, off_t)
+// pwrite( ) on the stream's descriptor
+// fpwrite( ) calls it without the stream lock, so it counts atomically
+//
+inline ssize_t io_pwrite(FILE* stream, const void* buf, size_t n, off_t off)
+{
+#ifdef STDIO_STATS
+   uint64_t start = stat_clock();
+   ssize_t put = pwrite(stream->fd, buf, n, off);
+   __atomic_add_fetch(&stream->stats.syscall_ns, stat_clock() - start,
+      __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stream->stats.writes, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stream->stats.bytes_written, (put > 0) ? put : 0,
+      __ATOMIC_RELAXED);
+   return put;
+#else
+   return pwrite(stream->fd, buf, n, off);
+#endif
+} // end io_pwrite
+
+// --------------------------------------- io_write(FILE*, const void*, size_t)
+// write( ) on the stream's descriptor
+//
+inline ssize_t io_write(FILE* stream, const void* buf, size_t n)
+{
+#ifdef STDIO_STATS
+   uint64_t start = stat_clock();
+   ssize_t put = write(stream->fd, buf, n);
+   stream->stats.syscall_ns += stat_clock() - start;
+   stream->stats.writes++;
+   stream->stats.bytes_written += (put > 0) ? put : 0;
+   return put;
+#else
+   return write(stream->fd, buf, n);
+#endif
+} // end io_write
+
+// ------------------------------------------------ io_lseek(FILE*, off_t, int)
+// lseek( ) on the stream's descriptor
+//
+inline off_t io_lseek(FILE* stream, off_t off, int whence)
+{
+#ifdef STDIO_STATS
+   uint64_t start = stat_clock();
+   off_t result = lseek(stream->fd, off, whence);
+   stream->stats.syscall_ns += stat_clock() - start;
+   stream->stats.seeks++;
+   return result;
+#else
+   return lseek(stream->fd, off, whence);
+#endif
+} // end io_lseek
+
+// ------------------------------------ io_writeall(FILE*, const char*, size_t)
+// writeall( ) on the stream's descriptor, counting every write( )
+//
+ssize_t io_writeall(FILE* stream, const char* buf, size_t len)
+{
+   size_t done = 0;                          // Bytes written so far
+
+   while (done < len)
    {
-      refill(stream);
-      if (stream->actual_size == -1)
+      ssize_t n = io_write(stream, buf + done, len - done);
+      if (n <= 0)                            // write() returns -1 on error
       {
-         return -1;
+         break;
       }
+      done += n;
    }
-   if (stream->lastop == 'w')                   // Flush written data
+   if (stream->ds != NULL && done > 0)       // Count toward durability
    {
-      fflush(stream);
+      dsync_note(stream, done);
    }
+   return (done > 0 || len == 0) ? (ssize_t)done : -1;
+} // end io_writeall
 
-   size_t totalMem = size * nmemb;              // Total memory needed
-   size_t offset = 0;                           // Total memory read
-   char* buf = (char*)ptr;                      // Current user buffer position
-   char* sbuf = stream->buffer + stream->pos;   // Current file buffer position
+// ---------------------------------------------- io_writev(FILE*, iovec*, int)
+// writev( ) on the stream's descriptor
+//
+inline ssize_t io_writev(FILE* stream, const struct iovec* iov, int cnt)
+{
+#ifdef STDIO_STATS
+   uint64_t start = stat_clock();
+   ssize_t put = writev(stream->fd, iov, cnt);
+   stream->stats.syscall_ns += stat_clock() - start;
+   stream->stats.writes++;
+   stream->stats.bytes_written += (put > 0) ? put : 0;
+   return put;
+#else
+   return writev(stream->fd, iov, cnt);
+#endif
+} // end io_writev
 
-   // EOF reached in buffer
-   if (stream->eof)                             // EOF read into buffer
+// ----------------------------------------------- io_readv(FILE*, iovec*, int)
+// readv( ) on the stream's descriptor
+//
+inline ssize_t io_readv(FILE* stream, const struct iovec* iov, int cnt)
+{
+#ifdef STDIO_STATS
+   uint64_t start = stat_clock();
+   ssize_t got = readv(stream->fd, iov, cnt);
+   stream->stats.syscall_ns += stat_clock() - start;
+   stream->stats.reads++;
+   stream->stats.bytes_read += (got > 0) ? got : 0;
+   return got;
+#else
+   return readv(stream->fd, iov, cnt);
+#endif
+} // end io_readv
+
+// ------------------------------------------- io_writevall(FILE*, iovec*, int)
+// Gathers several blocks into as few writev( )s as the kernel allows,
+//   retrying on short writes
+// The iovec array is consumed as it is written
+//
+// return: Number of bytes written, -1 if nothing could be written
+//
+ssize_t io_writevall(FILE* stream, struct iovec* iov, int cnt)
+{
+   size_t done = 0;                          // Bytes written so far
+
+   while (cnt > 0)
    {
-      if (stream->pos != stream->actual_size)   // Buffer not finished
+      ssize_t n = io_writev(stream, iov, cnt);
+      if (n <= 0)                            // writev() returns -1 on error
       {
-         offset = stream->actual_size - stream->pos;
-         memcpy(buf, sbuf, offset);             // Finish reading buffer
-
-         stream->pos = stream->actual_size;
-         stream->lastop = 'r';
-         return offset;
+         break;
       }
-      else                                      // Buffer finished
+      done += n;
+      while (cnt > 0 && (size_t)n >= iov->iov_len) // Drop finished blocks
       {
-         stream->lastop = 'r';
-         fpurge(stream);                        // Just clear buffer & return 0
-         return 0;
+         n -= iov->iov_len;
+         iov++;
+         cnt--;
+      }
+      if (cnt > 0)                           // Resume inside a block
+      {
+         iov->iov_base = (char*)iov->iov_base + n;
+         iov->iov_len -= n;
       }
    }
-
-   // No buffer allowed
-   if (stream->size == 0 || stream->mode == _IONBF) // No buffer
+   if (stream->ds != NULL && done > 0)       // Count toward durability
    {
-      stream->actual_size = read(stream->fd, buf, totalMem); // Read from disk
+      dsync_note(stream, done);
+   }
+   return (done > 0 || cnt == 0) ? (ssize_t)done : -1;
+} // end io_writevall
 
-      if (stream->actual_size != -1)
+#define COPY_RANGE 0                // copy_file_range( ), in the file system
+#define COPY_SENDFILE 1             // sendfile( ), in the page cache
+#define COPY_SPLICE 2               // splice( ) through a pipe
+#define COPY_BUFFER 3               // fread( ) and fwrite( ), no kernel help
+
+// ----------------------------------- io_copy(FILE*, FILE*, size_t, int, int*)
+// Moves up to n bytes from src's descriptor to dst's in the kernel, at
+//   and advancing both descriptor offsets
+//
+// param: how     COPY_RANGE, COPY_SENDFILE or COPY_SPLICE
+// param: pipefd  Pipe for COPY_SPLICE, empty between calls
+//
+// return: Bytes moved, 0 at end of file, -1 on error
+//
+ssize_t io_copy(FILE* dst, FILE* src, size_t n, int how, int* pipefd)
+{
+#ifdef STDIO_STATS
+   uint64_t start = stat_clock();
+#endif
+   ssize_t moved = -1;
+   switch (how)
+   {
+   case COPY_RANGE:
+      moved = copy_file_range(src->fd, NULL, dst->fd, NULL, n, 0);
+      break;
+   case COPY_SENDFILE:
+      moved = sendfile(dst->fd, src->fd, NULL, n);
+      break;
+   case COPY_SPLICE:
+      moved = splice(src->fd, NULL, pipefd[1], NULL, n, SPLICE_F_MOVE);
+      for (ssize_t out = 0; moved > 0 && out < moved; )
       {
-         if (stream->actual_size < stream->size)
+         ssize_t put = splice(pipefd[0], NULL, dst->fd, NULL, moved - out,
+            SPLICE_F_MOVE);
+         if (put <= 0)                       // Stranded in the pipe
          {
-            stream->eof = true;
+            moved = -1;
+            break;
          }
-         stream->fpos += stream->actual_size;
-         stream->lastop = 'r';
-         return stream->actual_size;
+         out += put;
       }
+      break;
    }
+#ifdef STDIO_STATS
+   src->stats.syscall_ns += stat_clock() - start;
+   src->stats.reads++;
+   src->stats.bytes_read += (moved > 0) ? moved : 0;
+   dst->stats.writes++;
+   dst->stats.bytes_written += (moved > 0) ? moved : 0;
+#endif
+   return moved;
+} // end io_copy
 
-   // Requested memory is less than remaining unread buffer contents
-   if (totalMem + stream->pos <= stream->size)  // Wants unread mem in buffer
+// ----------------------------------------------------- stream_register(FILE*)
+// Adds a newly opened stream to the list of open streams, which
+//   fflush(NULL), the exit flush, the background flusher and
+//   fstats_dumpall( ) walk
+// The first stream opened sets up the exit flush
+//
+void stream_register(FILE* stream)
+{
+   pthread_once(&streamonce, flushall_setup);
+   pthread_mutex_lock(&streamlock);
+   stream->prev = NULL;
+   stream->next = openstreams;
+   if (openstreams != NULL)
    {
-      if (stream->actual_size != -1)
-      {
-         memcpy(buf, sbuf, totalMem);           // Read the mem into user buff
-         buf += totalMem;                       // Move user buffer pointer
-         sbuf += totalMem;                      // Move file buffer pointer
-         offset += totalMem;                    // Track amount of mem passed
-         stream->pos += totalMem;               // Track position in file buff
-         stream->fpos += totalMem;              // Track position in file
-      }
+      openstreams->prev = stream;
    }
-   // Requested memory is more than remaining unread buffer contents
-   else                                         // Wants mem past end of buffer
+   openstreams = stream;
+   pthread_mutex_unlock(&streamlock);
+} // end stream_register
+
+// --------------------------------------------------- stream_unregister(FILE*)
+// Removes a closing stream from the list of open streams
+// Waits for any walk of the list in progress, so once this returns no
+//   other thread can reach the stream through it
+//
+void stream_unregister(FILE* stream)
+{
+   pthread_mutex_lock(&streamlock);
+   if (stream->prev != NULL)
    {
-      memcpy(buf, sbuf, stream->size - stream->pos);  // Read remaining buffer
-      buf += stream->size - stream->pos;
-      offset += stream->size - stream->pos;
-      stream->pos = 0;
+      stream->prev->next = stream->next;
+   }
+   else
+   {
+      openstreams = stream->next;
+   }
+   if (stream->next != NULL)
+   {
+      stream->next->prev = stream->prev;
+   }
+   pthread_mutex_unlock(&streamlock);
+} // end stream_unregister
 
-      while (totalMem - offset >= stream->size && !stream->eof)
-      {                                   // Loop until remainig mem < max buff
-         stream->actual_size = read(stream->fd, buf, stream->size);
-         if (stream->actual_size == -1)
-         {
-            break;
-         }
-         if (stream->actual_size < stream->size)
-         {
-            stream->eof = true;
-         }
-         buf += stream->actual_size;
-         offset += stream->actual_size;
-         stream->fpos += stream->actual_size;
-      }
+/////////////////////////////////////////////////
+// Stream buffer pool                          //
+/////////////////////////////////////////////////
+
+// Buffers owned by streams come from power-of-two size classes between
+//   POOL_MINSIZE and POOL_MAXSIZE, so short-lived streams reuse each
+//   other's buffers instead of going back to the allocator
+// Every buffer is page aligned
+// Freed buffers go to a small per-thread list first, then to a shared
+//   list per class, and back to the system once both are full
+// Building with STDIO_POOL_HUGEPAGES carves the large classes out of
+//   2 MB slabs advised MADV_HUGEPAGE
+#define POOL_MINSIZE 8192                   // Smallest size class
+#define POOL_MAXSIZE (1024 * 1024)          // Largest size class
+#define POOL_CLASSES 8                      // 8K 16K 32K ... 1M
+#define POOL_ALIGN 4096                     // Buffer alignment
+#define POOL_THREAD_BYTES (1024 * 1024)     // Per-thread cache per class
+#define POOL_SHARED_BYTES (16 * 1024 * 1024)// Shared cache per class
+#define POOL_SLAB (2 * 1024 * 1024)         // Huge-page slab size
+#define POOL_SLAB_MINSIZE (256 * 1024)      // Smallest class cut from slabs
+
+// Shared free list for one size class
+struct poolclass
+{
+   pthread_mutex_t lock;                    // Guards head and count
+   char* head;                              // First free buffer
+   size_t count;                            // Buffers in the list
+};
+
+static poolclass poolshared[POOL_CLASSES] =
+{
+   { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+   { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+   { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+   { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+   { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+   { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+   { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+   { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+static bufpool_stats poolstats;             // Updated with atomic adds
 
-      if (offset <= totalMem && !stream->eof)   // Read remaining mem needed
+void bufpool_release(int cls, char* buf);
+
+// Per-thread free lists, handed to the shared lists when the thread exits
+struct poolcache
+{
+   char* head[POOL_CLASSES];                // First free buffer per class
+   size_t count[POOL_CLASSES];              // Buffers per class
+
+   ~poolcache()
+   {
+      for (int cls = 0; cls < POOL_CLASSES; cls++)
       {
-         refill(stream);
-         if (stream->actual_size != -1)
+         while (head[cls] != NULL)
          {
-            sbuf = stream->buffer;
-
-            memcpy(buf, sbuf, totalMem - offset);
-            stream->pos += totalMem - offset;
-            stream->fpos += totalMem - offset;
-            buf += totalMem - offset;
-            sbuf += totalMem - offset;
-            offset = totalMem;
+            char* buf = head[cls];
+            head[cls] = *(char**)buf;
+            bufpool_release(cls, buf);
          }
       }
-      else
-      {
-         stream->pos = stream->actual_size;
-      }
    }
+};
 
-   stream->lastop = 'r';
-   if (stream->actual_size == -1)               // read() returns -1 on error
-      return -1;
-   else
-      return offset;
-} // end fread
+static thread_local poolcache poolmine;
 
-// --------------------------------- fwrite(const void*, size_t, size_t, FILE*)
-// Inputs data from the user buffer into the stream buffer then into the file
-// 
-// param: ptr     Pointer to an index in the user buffer
-// param: size    Byte size of one unit in the user buffer
-// param: nmemb   Number of units to read
-// param: stream  Pointer to the file object being written to
-// 
-// pre:    The file has been initialized an opened
-// post:   Requested amount of memory is read from the file to the user
-//           buffer, up to the end of the file
-//         EOF is set to true if amount read is less than buffer size
+// -------------------------------------------------------- poolclassof(size_t)
+// Finds the size class for a buffer size
 //
-size_t fwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream)
+// param: size    Requested buffer size
+//
+// return: Class index, -1 if size is above POOL_MAXSIZE
+//
+int poolclassof(size_t size)
 {
-   if (stream->flag == O_RDONLY)                      // Permissions check
+   if (size > POOL_MAXSIZE)
    {
-      printf("Write permissions not granted\n");
       return -1;
    }
-   if (stream->flag == (O_WRONLY | O_CREAT | O_APPEND) ||
-      stream->flag == (O_RDWR | O_CREAT | O_APPEND))  // Append check
+
+   int cls = 0;
+   size_t classsize = POOL_MINSIZE;
+   while (classsize < size)
    {
-      stream->fpos = lseek(stream->fd, 0, SEEK_END);
+      classsize *= 2;
+      cls++;
    }
-   if (stream == nullptr)                             // Parameter validation
+   return cls;
+} // end poolclassof
+
+// ---------------------------------------------------------- bufpool_slab(int)
+// Cuts a 2 MB huge-page slab into buffers of one size class and puts all
+//   but one of them on the shared list
+// The slab is aligned to 2 MB, or the kernel cannot back it with a huge
+//   page
+//
+// param: cls     Size class being refilled
+//
+// return: One buffer from the new slab, NULL if the slab could not be made
+//
+char* bufpool_slab(int cls)
+{
+#if defined(STDIO_POOL_HUGEPAGES) && defined(MADV_HUGEPAGE)
+   size_t classsize = (size_t)POOL_MINSIZE << cls;
+   if (classsize < POOL_SLAB_MINSIZE)
    {
-      printf("Null file parameter");
-      return -1;
+      return NULL;
    }
-   if (size < 1 || nmemb < 1)                         // Parameter validation
+
+   void* map = mmap(NULL, 2 * POOL_SLAB, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);  // Twice over, to align it
+   if (map == MAP_FAILED)
    {
-      printf("Invalid memory parameter");
-      return -1;
+      return NULL;
    }
-
-
-   size_t totalMem = size * nmemb;                    // Total mem to write
-   size_t written = 0;                                // Total written mem
-   size_t offset = 0;                                 // Written per loop
-   char* in = (char*)ptr;                             // Pointer to user buffer
-
-   if (stream->size == 0 || stream->mode == _IONBF)   // No buffer
+   uintptr_t start = (uintptr_t)map;
+   uintptr_t slab = (start + POOL_SLAB - 1) & ~(uintptr_t)(POOL_SLAB - 1);
+   if (slab > start)                        // Trim to one aligned slab
    {
-      written = write(stream->fd, stream->buffer, totalMem);
-      stream->fpos += written;
-
-      stream->lastop = 'w';
-      return written;
+      munmap(map, slab - start);
    }
+   munmap((void*)(slab + POOL_SLAB), start + POOL_SLAB - slab);
+   madvise((void*)slab, POOL_SLAB, MADV_HUGEPAGE);
 
-   if (stream->lastop == 'r')                         // Purge after reads
+   poolclass* shared = &poolshared[cls];
+   pthread_mutex_lock(&shared->lock);
+   for (size_t off = classsize; off < POOL_SLAB; off += classsize)
    {
-      fpurge(stream);
+      char* buf = (char*)slab + off;
+      *(char**)buf = shared->head;
+      shared->head = buf;
+      shared->count++;
    }
+   pthread_mutex_unlock(&shared->lock);
+   return (char*)slab;
+#else
+   (void)cls;
+   return NULL;
+#endif
+} // end bufpool_slab
 
-   while (written < totalMem) // Loop until requested amount of mem is read
+// ------------------------------------------------------- bufpool_get(size_t*)
+// Hands out a page-aligned buffer of at least *size bytes
+// Sizes are rounded up to their size class, and *size is updated so the
+//   caller can use the whole buffer
+//
+// param: size    Requested size in, usable size out
+//
+// return: The buffer, NULL if memory ran out
+//
+char* bufpool_get(size_t* size)
+{
+   if (*size < POOL_MINSIZE)
    {
-      offset = 0;
+      *size = POOL_MINSIZE;
+   }
 
-      while (*in != '\0' && offset < stream->size && offset < totalMem)
-      {                       // Loop until end of input, buffer, or total mem
-         stream->buffer[offset] = *in;
-         in++;
-         offset++;
+   int cls = poolclassof(*size);
+   if (cls == -1)                           // Too big to pool
+   {
+      __atomic_add_fetch(&poolstats.misses, 1, __ATOMIC_RELAXED);
+      void* buf;
+      if (posix_memalign(&buf, POOL_ALIGN, *size) != 0)
+      {
+         return NULL;
       }
+      return (char*)buf;
+   }
+   *size = (size_t)POOL_MINSIZE << cls;
 
-      write(stream->fd, stream->buffer, offset);      // Write to file
-      stream->fpos += offset;                         // Advance file position
+   char* buf = poolmine.head[cls];          // This thread's list first
+   if (buf != NULL)
+   {
+      poolmine.head[cls] = *(char**)buf;
+      poolmine.count[cls]--;
+      __atomic_add_fetch(&poolstats.hits, 1, __ATOMIC_RELAXED);
+      return buf;
+   }
 
-      written += offset;
+   poolclass* shared = &poolshared[cls];    // Then the shared list
+   pthread_mutex_lock(&shared->lock);
+   buf = shared->head;
+   if (buf != NULL)
+   {
+      shared->head = *(char**)buf;
+      shared->count--;
+   }
+   pthread_mutex_unlock(&shared->lock);
+   if (buf != NULL)
+   {
+      __atomic_add_fetch(&poolstats.hits, 1, __ATOMIC_RELAXED);
+      return buf;
    }
 
-   stream->lastop = 'w';
-   return written;
-} // end fwrite
+   __atomic_add_fetch(&poolstats.misses, 1, __ATOMIC_RELAXED);
+   if ((buf = bufpool_slab(cls)) != NULL)   // Then a huge-page slab
+   {
+      return buf;
+   }
+   void* fresh;                             // Then the system
+   if (posix_memalign(&fresh, POOL_ALIGN, *size) != 0)
+   {
+      return NULL;
+   }
+   return (char*)fresh;
+} // end bufpool_get
 
-// --------------------------------------------------------------- fgetc(FILE*)
-// Read a single character from the file/buffer and return it
-// 
-// param: stream  Pointer to the file object being read from
-// 
-// pre:    The file has been initialized an opened
-// post:   One char will have been read from the file or buffer
-// return: char value that was read
+// ------------------------------------------------ bufpool_release(int, char*)
+// Moves a buffer to the shared list for its class, or frees it if that
+//   list is full
 //
-int fgetc(FILE* stream)
+// param: cls     Size class of the buffer
+// param: buf     Buffer being released
+//
+void bufpool_release(int cls, char* buf)
 {
-   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
-      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))// Permissions check
+   size_t classsize = (size_t)POOL_MINSIZE << cls;
+   poolclass* shared = &poolshared[cls];
+
+   pthread_mutex_lock(&shared->lock);
+   bool keep = (shared->count < POOL_SHARED_BYTES / classsize);
+   bool slab = false;
+#if defined(STDIO_POOL_HUGEPAGES) && defined(MADV_HUGEPAGE)
+   slab = (classsize >= POOL_SLAB_MINSIZE);  // Slab pieces are never freed
+#endif
+   if (keep || slab)
    {
-      printf("Read permissions not granted\n");
-      return -1;
+      *(char**)buf = shared->head;
+      shared->head = buf;
+      shared->count++;
    }
-   if (stream == nullptr)                             // Parameter validation
+   pthread_mutex_unlock(&shared->lock);
+
+   if (!keep && !slab)
    {
-      printf("Null file parameter");
-      return -1;
+      __atomic_add_fetch(&poolstats.released, 1, __ATOMIC_RELAXED);
+      free(buf);
    }
-   if (stream->size == 0 || stream->mode == _IONBF)   // No buffer
-   {
-      char c;
-      stream->actual_size = read(stream->fd, &c, 1);  // Read from disk
-      stream->lastop = 'r';
+} // end bufpool_release
 
-      if (stream->actual_size != -1)
-      {
+// ------------------------------------------------- bufpool_put(char*, size_t)
+// Returns a buffer from bufpool_get( ) to the pool
+//
+// param: buf     Buffer being returned, NULL is ignored
+// param: size    Usable size reported by bufpool_get( )
+//
+void bufpool_put(char* buf, size_t size)
+{
+   if (buf == NULL)
+   {
+      return;
+   }
+   __atomic_add_fetch(&poolstats.frees, 1, __ATOMIC_RELAXED);
+
+   int cls = poolclassof(size);
+   if (cls == -1)                           // Was never pooled
+   {
+      free(buf);
+      return;
+   }
+
+   size_t limit = POOL_THREAD_BYTES / size;
+   if (poolmine.count[cls] < ((limit > 2) ? limit : 2)) // This thread's list
+   {
+      *(char**)buf = poolmine.head[cls];
+      poolmine.head[cls] = buf;
+      poolmine.count[cls]++;
+      return;
+   }
+   bufpool_release(cls, buf);
+} // end bufpool_put
+
+// ------------------------------------------- bufpool_getstats(bufpool_stats*)
+// Copies the pool's counters
+//
+// param: stats   Filled with the current hit, miss, free and release counts
+//
+void bufpool_getstats(bufpool_stats* stats)
+{
+   stats->hits = __atomic_load_n(&poolstats.hits, __ATOMIC_RELAXED);
+   stats->misses = __atomic_load_n(&poolstats.misses, __ATOMIC_RELAXED);
+   stats->frees = __atomic_load_n(&poolstats.frees, __ATOMIC_RELAXED);
+   stats->released = __atomic_load_n(&poolstats.released, __ATOMIC_RELAXED);
+} // end bufpool_getstats
+
+// ------------------------------------------------------------ bufalloc(FILE*)
+// Gives a stream the pooled buffer fopen( ) or setvbuf( ) only sized, on
+//   its first read or write, so a stream opened and closed without I/O
+//   never holds one
+//
+// param: stream  Pointer to the file object about to use its buffer
+//
+// pre:    The stream is buffered and owns its (missing) buffer
+// post:   buffer is allocated and size is rounded up to its size class
+// return: 0 on success, -1 if the buffer could not be allocated
+//
+int bufalloc(FILE* stream)
+{
+   if (stream->buffer != (char*)0)
+   {
+      return 0;
+   }
+
+   size_t size = (stream->size > 0) ? stream->size : BUFSIZ;
+   char* buf = bufpool_get(&size);
+   if (buf == NULL)
+   {
+      printf("Out of memory for stream buffer\n");
+      return -1;
+   }
+   stream->buffer = buf;
+   stream->size = size;
+   stream->bufown = true;
+   return 0;
+} // end bufalloc
+
+/////////////////////////////////////////////////
+// FILE slab                                   //
+/////////////////////////////////////////////////
+
+// FILE objects are cut FILE_SLAB at a time out of cache-aligned slabs and
+//   recycled through a free list, so a job holding thousands of streams
+//   open makes one allocation per FILE_SLAB of them and every FILE's hot
+//   fields share one cache line
+// Unused slots link through their first bytes; slabs are never freed
+#define FILE_SLAB 64                        // FILE objects per slab
+
+static char* filefree = NULL;               // First unused slot
+static pthread_mutex_t filelock = PTHREAD_MUTEX_INITIALIZER;
+
+// --------------------------------------------------------------- file_alloc()
+// Constructs a FILE in a slot taken from the free list, adding a slab to
+//   the list when it is empty
+//
+// return: The new FILE, NULL if no slab could be allocated
+//
+FILE* file_alloc()
+{
+   pthread_mutex_lock(&filelock);
+   if (filefree == NULL)
+   {
+      void* slab;
+      if (posix_memalign(&slab, alignof(FILE), FILE_SLAB * sizeof(FILE)) != 0)
+      {
+         pthread_mutex_unlock(&filelock);
+         return NULL;
+      }
+      for (int i = FILE_SLAB - 1; i >= 0; i--) // Hand out in address order
+      {
+         char* slot = (char*)slab + i * sizeof(FILE);
+         *(char**)slot = filefree;
+         filefree = slot;
+      }
+   }
+   char* slot = filefree;
+   filefree = *(char**)slot;
+   pthread_mutex_unlock(&filelock);
+   return new (slot) FILE();
+} // end file_alloc
+
+// ----------------------------------------------------------- file_free(FILE*)
+// Destroys a FILE from file_alloc( ) and puts its slot back on the list
+//
+void file_free(FILE* stream)
+{
+   stream->~FILE();
+   pthread_mutex_lock(&filelock);
+   *(char**)stream = filefree;
+   filefree = (char*)stream;
+   pthread_mutex_unlock(&filelock);
+} // end file_free
+
+/////////////////////////////////////////////////
+// Untouched methods provided by Prof. Dimpsey //
+/////////////////////////////////////////////////
+
+int setvbuf(FILE* stream, char* buf, int mode, size_t size)
+{
+   if (mode != _IONBF && mode != _IOLBF && mode != _IOFBF && mode != _IORA)
+   {
+      return -1;
+   }
+   if (!lz_allows(stream, mode, size))       // Blocks need a buffer
+   {
+      printf("Mode not supported on compressed streams\n");
+      return -1;
+   }
+   if (!dio_allows(stream, buf, mode, size)) // Blocks need alignment
+   {
+      printf("Mode or buffer not supported on direct streams\n");
+      return -1;
+   }
+   flockfile(stream);
+   if (stream->mapped)
+   {
+      funmap(stream);
+   }
+   if (stream->ra != NULL)
+   {
+      ra_stop(stream);
+   }
+   stream->mode = mode;
+   stream->pos = 0;
+   stream->autosize = false;
+   if (stream->buffer != (char*)0 && stream->bufown == true)
+   {
+      bufpool_put(stream->buffer, stream->size);
+   }
+
+   switch (mode)
+   {
+   case _IONBF:
+      stream->buffer = (char*)0;
+      stream->size = 0;
+      stream->bufown = false;
+      break;
+   case _IOLBF:
+   case _IOFBF:
+   case _IORA:
+      if (buf != (char*)0 && mode != _IORA) // _IORA swaps pooled buffers
+      {
+         stream->buffer = buf;
+         stream->size = size;
+         stream->bufown = false;
+      }
+      else
+      {
+         size = (size > 0) ? size : BUFSIZ;  // Pooled, see bufalloc( )
+         stream->buffer = (char*)0;
+         stream->size = size;
+         stream->bufown = true;
+      }
+      break;
+   }
+   funlockfile(stream);
+   return 0;
+}
+
+void setbuf(FILE* stream, char* buf)
+{
+   setvbuf(stream, buf, (buf != (char*)0) ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+FILE* fopen(const char* path, const char* mode)
+{
+   FILE* stream = file_alloc();
+   if (stream == NULL)
+   {
+      printf("fopen failed\n");
+      return NULL;
+   }
+   setvbuf(stream, (char*)0, _IOFBF, BUFSIZ); // Allocated on first use
+
+   // fopen( ) mode
+   // r or rb = O_RDONLY
+   // w or wb = O_WRONLY | O_CREAT | O_TRUNC
+   // a or ab = O_WRONLY | O_CREAT | O_APPEND
+   // r+ or rb+ or r+b = O_RDWR
+   // w+ or wb+ or w+b = O_RDWR | O_CREAT | O_TRUNC
+   // a+ or ab+ or a+b = O_RDWR | O_CREAT | O_APPEND
+
+   // Modifiers may follow the mode in any order:
+   // m = memory-map the file instead of reading it through the buffer
+   //       (ignored unless the mode is read-only)
+   // z = compress the file in blocks, see setcompress( )
+   //       (ignored unless the mode is "r" or "w"; takes precedence over m)
+   // d = open with O_DIRECT so reads and writes bypass the page cache
+   //       (ignored in append modes and with z; takes precedence over m)
+
+   bool plus = (strchr(mode, '+') != NULL);   // Read & write requested
+
+   switch (mode[0])
+   {
+   case 'r':
+      stream->flag = plus ? O_RDWR : O_RDONLY;
+      break;
+
+   case 'w':
+      stream->flag = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+      break;
+
+   case 'a':
+      stream->flag = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+      break;
+
+   default:
+      file_free(stream);
+      printf("fopen failed\n");
+      return NULL;
+   }
+
+   mode_t open_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+   bool pure = !plus && (mode[0] == 'r' || mode[0] == 'w');
+   bool compress = (strchr(mode, 'z') != NULL && pure);
+   stream->direct = (strchr(mode, 'd') != NULL && mode[0] != 'a' &&
+      !compress);
+   if (stream->direct)
+   {
+      stream->fd = open(path, stream->flag | O_DIRECT, open_mode);
+      if (stream->fd == -1 && errno == EINVAL) // Filesystem refuses it
+      {
+         stream->direct = false;
+      }
+   }
+   if (!stream->direct)
+   {
+      stream->fd = open(path, stream->flag, open_mode);
+   }
+   if (stream->fd == -1)                      // Missing, denied, ...
+   {
+      file_free(stream);
+      printf("fopen failed\n");
+      return NULL;
+   }
+
+   if (compress)
+   {
+      lz_start(stream);
+   }
+   else if (strchr(mode, 'm') != NULL && stream->flag == O_RDONLY &&
+      !stream->direct)
+   {
+      fmap(stream);
+   }
+   if (stream->flag & O_TRUNC)                // Size known without a stat
+   {
+      stream->fsize = 0;
+   }
+   if (!stream->mapped && stream->lz == NULL) // Size the buffer to the file
+   {
+      adapt_open(stream);
+   }
+   stream_register(stream);
+
+   return stream;
+}
+
+///////////////////////////////////////
+// Methods written by Korosh Moosavi //
+///////////////////////////////////////
+
+// ---------------------------------------------------------------- fmap(FILE*)
+// Replaces a read-only stream's buffer with a private mapping of the whole
+//   file, so reads become memcpy()s and seeks become pointer arithmetic
+// The mapping is advised MADV_SEQUENTIAL until the stream first seeks
+// Falls back to the normal buffer for empty, irregular or oversized files
+//
+// param: stream  Pointer to the file object being mapped
+//
+// pre:    The file has been opened read-only and nothing has been read
+// post:   buffer covers the whole file and EOF is set, on success
+// return: 0 on success, -1 if the stream keeps its normal buffer
+//
+int fmap(FILE* stream)
+{
+   struct stat st;                           // File type and size
+
+   if (fstat(stream->fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_size == 0 || st.st_size > SSIZE_MAX)
+   {
+      return -1;                             // Nothing (sensible) to map
+   }
+
+   void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, stream->fd, 0);
+   if (addr == MAP_FAILED)
+   {
+      return -1;
+   }
+   madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+   if (stream->bufown)                       // Drop the unused buffer
+   {
+      bufpool_put(stream->buffer, stream->size);
+   }
+   stream->buffer = (char*)addr;
+   stream->size = st.st_size;
+   stream->actual_size = st.st_size;         // Whole file is "read in"
+   stream->pos = 0;
+   stream->bufown = false;
+   stream->mapped = true;
+   stream->seqhint = true;
+   stream->eof = true;
+   return 0;
+} // end fmap
+
+// -------------------------------------------------------------- funmap(FILE*)
+// Releases a stream's file mapping and puts the descriptor where the
+//   stream's position says it should be, so normal reads can resume
+//
+// param: stream  Pointer to the file object being unmapped
+//
+// post:   The mapping is gone and the stream has no buffer
+//
+void funmap(FILE* stream)
+{
+   munmap(stream->buffer, stream->size);
+   io_lseek(stream, stream->fpos, SEEK_SET);
+
+   stream->buffer = (char*)0;
+   stream->size = 0;
+   stream->actual_size = 0;
+   stream->pos = 0;
+   stream->mapped = false;
+   stream->eof = false;
+   stream->lastop = 0;
+} // end funmap
+
+// ------------------------------------------------------- fsize_refresh(FILE*)
+// Re-reads the file size into the stream's cache
+//
+// param: stream  Pointer to the file object whose size is cached
+//
+// post:   fsize holds the size on disk plus any data still buffered
+//           past it, or -1 if the size cannot be read (pipes, ttys)
+//
+void fsize_refresh(FILE* stream)
+{
+   struct stat st;
+
+   if (fstat(stream->fd, &st) == -1 || !S_ISREG(st.st_mode))
+   {
+      stream->fsize = -1;
+      return;
+   }
+   stream->fsize = st.st_size;
+   if (stream->lastop == 'w' && stream->fpos > stream->fsize)
+   {
+      stream->fsize = stream->fpos;          // Unflushed data extends it
+   }
+} // end fsize_refresh
+
+// Adaptive sizing for buffers chosen by fopen( )
+// The first buffer follows st_blksize, and starts larger for big files
+// refill( ) doubles it every ADAPT_GROW_AFTER sequential refills, up to
+//   the largest pool class, and advises the kernel POSIX_FADV_SEQUENTIAL
+// fseek( ) goes back to the first size and advises POSIX_FADV_RANDOM once
+//   ADAPT_RANDOM_AFTER seeks in a row leave a buffer after one refill
+// fclose( ) drops the pages of a long sequential scan from the page cache
+// setvbuf( ) turns sizing off; _IORA and mapped streams never use it
+#define ADAPT_BIGFILE (1024 * 1024)         // Files this large start bigger
+#define ADAPT_BIGSTART (64 * 1024)          // Their first buffer size
+#define ADAPT_GROW_AFTER 4                  // Sequential refills per doubling
+#define ADAPT_RANDOM_AFTER 2                // Random seeks before shrinking
+#define ADAPT_DROP_BYTES (64LL * 1024 * 1024) // Scans fclose( ) drops
+
+// Access pattern of a stream being sized, made on its first refill or
+//   seek so streams that never read hold none
+struct adaptstate
+{
+   ssize_t basesize;                // Buffer size chosen at fopen( )
+   off_t seqbytes;                  // Bytes consumed while advised sequential
+   int seqrun;                      // Refills since the last seek out
+   int rndrun;                      // Seeks in a row after one refill at most
+   int advice;                      // Last posix_fadvise( ) advice, 0 if none
+};
+
+// ------------------------------------------------ adapt_resize(FILE*, size_t)
+// Swaps an empty stream buffer for a pooled one of another size
+// Keeps the old buffer if the pool has no memory
+// A buffer not allocated yet only changes the size bufalloc( ) will use
+//
+// param: stream  Pointer to the file object being resized
+// param: size    New buffer size, rounded up to its pool class
+//
+// pre:    The buffer holds no unread or unwritten data
+// post:   The buffer has the new size and is empty
+//
+void adapt_resize(FILE* stream, size_t size)
+{
+   if (stream->buffer == (char*)0)           // Not allocated yet, just size
+   {
+      stream->size = size;
+      return;
+   }
+
+   size_t want = size;
+   char* buf = bufpool_get(&want);
+   if (buf == NULL)
+   {
+      return;
+   }
+   bufpool_put(stream->buffer, stream->size);
+   stream->buffer = buf;
+   stream->size = want;
+   stream->pos = 0;
+   stream->actual_size = 0;
+} // end adapt_resize
+
+// --------------------------------------------------------- adapt_state(FILE*)
+// Returns a sized stream's access pattern, making it on first use
+// Nothing has resized the buffer before then, so its size is still the
+//   one adapt_open( ) chose
+//
+adaptstate* adapt_state(FILE* stream)
+{
+   if (stream->ad == NULL)
+   {
+      stream->ad = new adaptstate();
+      stream->ad->basesize = stream->size;
+   }
+   return stream->ad;
+} // end adapt_state
+
+// --------------------------------------------------- adapt_advise(FILE*, int)
+// Passes an access pattern on to the kernel, once per change
+//
+void adapt_advise(FILE* stream, int advice)
+{
+   if (stream->ad->advice != advice)
+   {
+      posix_fadvise(stream->fd, 0, 0, advice);
+      stream->ad->advice = advice;
+   }
+} // end adapt_advise
+
+// ---------------------------------------------------------- adapt_open(FILE*)
+// Picks the first buffer size of a newly opened regular file from its
+//   block size and length, and caches the length in fsize
+// Terminals become line buffered, so output shows up a line at a time
+// Pipes stay fully buffered with a buffer the size of the pipe, so one
+//   write can fill it; other special files keep BUFSIZ
+//
+// param: stream  Pointer to the file object just opened
+//
+// pre:    The stream holds an empty pooled buffer
+// post:   The buffer is sized for the file and sizing is turned on
+//
+void adapt_open(FILE* stream)
+{
+   struct stat st;                           // Block size and length
+
+   if (!stream->bufown || fstat(stream->fd, &st) == -1)
+   {
+      return;
+   }
+   if (isatty(stream->fd))                   // Someone is watching
+   {
+      stream->mode = _IOLBF;
+      return;
+   }
+   if (S_ISFIFO(st.st_mode))                 // Match the pipe's capacity
+   {
+#ifdef F_GETPIPE_SZ
+      int cap = fcntl(stream->fd, F_GETPIPE_SZ);
+      if (cap > stream->size && cap <= POOL_MAXSIZE)
+      {
+         adapt_resize(stream, cap);
+      }
+#endif
+      return;
+   }
+   if (!S_ISREG(st.st_mode))
+   {
+      return;
+   }
+   stream->fsize = st.st_size;
+
+   int size = (st.st_blksize > BUFSIZ) ? st.st_blksize : BUFSIZ;
+   if (st.st_size >= ADAPT_BIGFILE && size < ADAPT_BIGSTART)
+   {
+      size = ADAPT_BIGSTART;
+   }
+   if (size > POOL_MAXSIZE)
+   {
+      size = POOL_MAXSIZE;
+   }
+   if (size > stream->size)
+   {
+      adapt_resize(stream, size);
+   }
+   stream->autosize = true;
+} // end adapt_open
+
+// -------------------------------------------------------- adapt_refill(FILE*)
+// Counts a refill and grows the buffer while reads stay sequential
+// Called by refill( ) before it reads, when the buffer is used up
+//
+// param: stream  Pointer to the file object being refilled
+//
+// pre:    Everything in the buffer has been consumed
+// post:   The buffer may be larger, and is empty if it changed
+//
+void adapt_refill(FILE* stream)
+{
+   if (!stream->autosize)
+   {
+      return;
+   }
+   adaptstate* ad = adapt_state(stream);
+   if (ad->advice == POSIX_FADV_SEQUENTIAL)
+   {
+      ad->seqbytes += stream->actual_size;
+   }
+
+   ad->seqrun++;
+   if (ad->seqrun % ADAPT_GROW_AFTER != 0)  // Not convinced yet
+   {
+      return;
+   }
+   ad->rndrun = 0;
+   adapt_advise(stream, POSIX_FADV_SEQUENTIAL);
+   if (stream->size < POOL_MAXSIZE)
+   {
+      adapt_resize(stream, stream->size * 2);
+   }
+} // end adapt_refill
+
+// ---------------------------------------------------------- adapt_seek(FILE*)
+// Notes a seek out of the buffer and shrinks it if access looks random
+// Called by fseek( ) after it has dropped the buffer
+//
+// param: stream  Pointer to the file object being repositioned
+//
+// pre:    The buffer holds no unread or unwritten data
+// post:   The buffer may be back at its first size
+//
+void adapt_seek(FILE* stream)
+{
+   if (!stream->autosize)
+   {
+      return;
+   }
+
+   adaptstate* ad = adapt_state(stream);
+   ad->rndrun = (ad->seqrun <= 1) ? ad->rndrun + 1 : 0;
+   ad->seqrun = 0;
+   if (ad->rndrun < ADAPT_RANDOM_AFTER)
+   {
+      return;
+   }
+   adapt_advise(stream, POSIX_FADV_RANDOM);
+   ad->seqbytes = 0;
+   if (stream->size > ad->basesize)
+   {
+      adapt_resize(stream, ad->basesize);
+   }
+} // end adapt_seek
+
+// --------------------------------------------------------- adapt_close(FILE*)
+// Drops a long sequential scan's pages from the page cache, since a
+//   stream that read straight through is unlikely to read them again
+//
+// param: stream  Pointer to the file object being closed
+//
+// post:   The access pattern is freed
+//
+void adapt_close(FILE* stream)
+{
+   adaptstate* ad = stream->ad;
+   if (ad == NULL)
+   {
+      return;
+   }
+   if (ad->advice == POSIX_FADV_SEQUENTIAL &&
+      ad->seqbytes + stream->actual_size >= ADAPT_DROP_BYTES)
+   {
+      posix_fadvise(stream->fd, 0, 0, POSIX_FADV_DONTNEED);
+   }
+   delete ad;
+   stream->ad = NULL;
+} // end adapt_close
+
+// Background read-ahead state for a stream in _IORA mode
+// While the caller consumes the stream buffer, a worker thread fills
+//   spare with the next block; refill( ) then swaps the two buffers
+// Reads in this mode use pread( ), so the descriptor's offset is only
+//   brought back in line with the stream by ra_sync( )
+#define RA_IDLE 0                   // No read in flight, spare is unused
+#define RA_PENDING 1                // Worker is reading into spare
+#define RA_READY 2                  // spare holds got bytes from off
+#define RA_QUIT 3                   // Worker should exit
+
+struct rastate
+{
+   pthread_t thread;                // Worker filling spare
+   pthread_mutex_t lock;            // Guards everything below
+   pthread_cond_t cond;             // Signals state changes
+   int fd;                          // Descriptor being read
+   char* spare;                     // Buffer filled in the background
+   size_t size;                     // Size of spare (and the stream buffer)
+   off_t off;                       // File offset spare is read from
+   ssize_t got;                     // Bytes read into spare, -1 on error
+   int state;                       // RA_IDLE, RA_PENDING, RA_READY, RA_QUIT
+   bool synced;                     // Descriptor offset matches the stream
+};
+
+// ----------------------------------------------------------- ra_worker(void*)
+// Worker thread body: waits for a pending block, reads it, reports it
+//
+// param: arg     The stream's read-ahead state
+//
+void* ra_worker(void* arg)
+{
+   rastate* ra = (rastate*)arg;
+
+   pthread_mutex_lock(&ra->lock);
+   while (true)
+   {
+      while (ra->state != RA_PENDING && ra->state != RA_QUIT)
+      {
+         pthread_cond_wait(&ra->cond, &ra->lock);
+      }
+      if (ra->state == RA_QUIT)
+      {
+         break;
+      }
+
+      off_t off = ra->off;
+      pthread_mutex_unlock(&ra->lock);       // Read without the lock
+      ssize_t got = pread(ra->fd, ra->spare, ra->size, off);
+      pthread_mutex_lock(&ra->lock);
+
+      ra->got = got;
+      if (ra->state == RA_PENDING)
+      {
+         ra->state = RA_READY;
+      }
+      pthread_cond_broadcast(&ra->cond);
+   }
+   pthread_mutex_unlock(&ra->lock);
+   return NULL;
+} // end ra_worker
+
+// ------------------------------------------------------------ ra_start(FILE*)
+// Sets up read-ahead for a stream: a spare buffer and its worker thread
+// Streams that cannot pread( ) (pipes, ttys) fall back to _IOFBF
+//
+// param: stream  Pointer to the file object in _IORA mode
+//
+// return: 0 on success, -1 if the stream stays without read-ahead
+//
+int ra_start(FILE* stream)
+{
+   if (io_lseek(stream, 0, SEEK_CUR) == -1) // Not seekable
+   {
+      stream->mode = _IOFBF;
+      return -1;
+   }
+
+   rastate* ra = new rastate();
+   size_t size = stream->size;
+   ra->fd = stream->fd;
+   ra->spare = bufpool_get(&size);
+   ra->size = stream->size;
+   ra->state = RA_IDLE;
+   ra->synced = true;
+   pthread_mutex_init(&ra->lock, NULL);
+   pthread_cond_init(&ra->cond, NULL);
+
+   if (ra->spare == NULL ||
+      pthread_create(&ra->thread, NULL, ra_worker, ra) != 0)
+   {
+      bufpool_put(ra->spare, size);
+      pthread_mutex_destroy(&ra->lock);
+      pthread_cond_destroy(&ra->cond);
+      delete ra;
+      stream->mode = _IOFBF;
+      return -1;
+   }
+
+   stream->ra = ra;
+   return 0;
+} // end ra_start
+
+// ----------------------------------------------------------- ra_cancel(FILE*)
+// Discards any block read in the background, for callers that are about
+//   to move the descriptor themselves
+//
+// param: stream  Pointer to the file object in _IORA mode
+//
+// post:   No read is in flight and the next refill( ) reads synchronously
+//
+void ra_cancel(FILE* stream)
+{
+   rastate* ra = stream->ra;
+
+   pthread_mutex_lock(&ra->lock);
+   while (ra->state == RA_PENDING)           // Let the worker finish
+   {
+      pthread_cond_wait(&ra->cond, &ra->lock);
+   }
+   ra->state = RA_IDLE;
+   pthread_mutex_unlock(&ra->lock);
+   ra->synced = true;
+} // end ra_cancel
+
+// ------------------------------------------------------------- ra_sync(FILE*)
+// Discards any block read in the background and moves the descriptor to
+//   the end of the data in the stream buffer, as plain read( )s expect
+//
+// param: stream  Pointer to the file object in _IORA mode
+//
+// post:   No read is in flight and the descriptor offset is in line
+//
+void ra_sync(FILE* stream)
+{
+   rastate* ra = stream->ra;
+   bool synced = ra->synced;
+
+   ra_cancel(stream);
+   if (!synced)
+   {
+      io_lseek(stream, stream->fpos + (stream->actual_size - stream->pos),
+         SEEK_SET);
+      ra->synced = true;
+   }
+} // end ra_sync
+
+// ------------------------------------------------------------- ra_stop(FILE*)
+// Ends read-ahead for a stream: joins the worker and frees the spare buffer
+//
+// param: stream  Pointer to the file object in _IORA mode
+//
+// post:   stream->ra is NULL and the descriptor offset is in line
+//
+void ra_stop(FILE* stream)
+{
+   rastate* ra = stream->ra;
+
+   ra_sync(stream);
+   pthread_mutex_lock(&ra->lock);
+   ra->state = RA_QUIT;
+   pthread_cond_broadcast(&ra->cond);
+   pthread_mutex_unlock(&ra->lock);
+   pthread_join(ra->thread, NULL);
+
+   bufpool_put(ra->spare, ra->size);
+   pthread_mutex_destroy(&ra->lock);
+   pthread_cond_destroy(&ra->cond);
+   delete ra;
+   stream->ra = NULL;
+} // end ra_stop
+
+// ----------------------------------------------------------- ra_refill(FILE*)
+// Refills the stream buffer in _IORA mode
+// Swaps in the background block when it covers the next offset, waiting
+//   for it if it is still being read, otherwise reads synchronously
+// Then starts the worker on the block after it
+//
+// param: stream  Pointer to the file object in _IORA mode
+//
+// post:   actual_size holds the bytes now in the buffer, -1 on error
+//
+void ra_refill(FILE* stream)
+{
+   rastate* ra = stream->ra;
+   off_t next = stream->fpos + (stream->actual_size - stream->pos);
+
+   pthread_mutex_lock(&ra->lock);
+   if (ra->state != RA_IDLE && ra->off == next) // Our block is coming
+   {
+      while (ra->state == RA_PENDING)
+      {
+         pthread_cond_wait(&ra->cond, &ra->lock);
+      }
+      char* filled = ra->spare;              // Swap buffers, no copy
+      ra->spare = stream->buffer;
+      stream->buffer = filled;
+      stream->actual_size = ra->got;
+      STAT_ADD(stream, reads, 1);            // Read by the worker
+      STAT_ADD(stream, bytes_read, (ra->got > 0) ? ra->got : 0);
+   }
+   else                                      // Wrong or no block in flight
+   {
+      while (ra->state == RA_PENDING)
+      {
+         pthread_cond_wait(&ra->cond, &ra->lock);
+      }
+      pthread_mutex_unlock(&ra->lock);
+      stream->actual_size = io_pread(stream, stream->buffer, stream->size,
+         next);
+      pthread_mutex_lock(&ra->lock);
+   }
+   ra->state = RA_IDLE;
+   ra->synced = false;
+
+   if (stream->actual_size == stream->size)  // More to come, prefetch it
+   {
+      ra->off = next + stream->actual_size;
+      ra->state = RA_PENDING;
+      pthread_cond_broadcast(&ra->cond);
+   }
+   pthread_mutex_unlock(&ra->lock);
+} // end ra_refill
+
+// Block compression for streams opened with the 'z' mode modifier
+// Every flush of the stream buffer becomes one self-contained block:
+//   an 8-byte header (compressed length, LZ_STORED flag, raw length,
+//   both little-endian) followed by the payload
+// Payloads use an LZ4-style sequence format: a token of literal and match
+//   lengths, the literals, then a 2-byte offset back into the same block
+// Blocks that do not shrink are stored as they are
+// fpos and fsize count uncompressed bytes; reads use pread( ) at lz->foff,
+//   and fseek( ) jumps to the block holding its target through an index
+//   of block headers that is built as blocks are met
+#define LZ_STORED 0x80000000u       // Header flag, payload is not compressed
+#define LZ_HDRSIZE 8                // Bytes in a block header
+#define LZ_MINMATCH 4               // Shortest match encoded
+#define LZ_MAXOFF 65535             // Farthest match offset
+#define LZ_HASHLOG 14               // log2 of the match-finder table size
+#define LZ_MFLIMIT 12               // No match starts this close to the end
+#define LZ_LASTLITERALS 5           // Block always ends in this many literals
+#define LZ_DEFBLOCK (64 * 1024)     // Block size of a new stream
+#define LZ_MAXBLOCK (1 << 30)       // Largest block a header can describe
+#define LZ_DEFLEVEL 1               // Compression level of a new stream
+#define LZ_MAXLEVEL 9               // Slowest, most thorough level
+
+struct lzstate
+{
+   int level;                       // 0 stores blocks, 1-9 compress harder
+   uint32_t* table;                 // Writer: match finder, LZ_HASHLOG bits
+   char* scratch;                   // Compressed payload of one block
+   size_t cap;                      // Size of scratch
+   off_t foff;                      // Reader: file offset of the next block
+   off_t lnext;                     // Reader: stream offset of the next block
+   off_t cur;                       // Reader: file offset of buffered block
+   off_t curpos;                    // Reader: stream offset of buffered block
+   size_t skip;                     // Reader: bytes to skip in the next block
+   off_t* boff;                     // Index: file offset of each block
+   off_t* bpos;                     // Index: stream offset of each block
+   size_t count;                    // Index: blocks indexed
+   size_t room;                     // Index: capacity of boff and bpos
+   off_t scanoff;                   // Index: file offset after the last entry
+   off_t scanpos;                   // Index: stream offset after the last entry
+   bool complete;                   // Index: reached the end of the file
+};
+
+// ----------------------------------------------------- lz_read32(const void*)
+// Loads four unaligned bytes
+//
+inline uint32_t lz_read32(const void* p)
+{
+   uint32_t v;
+   memcpy(&v, p, 4);
+   return v;
+} // end lz_read32
+
+// ------------------------------------------------ lz_put32le(char*, uint32_t)
+// Stores a header field as four little-endian bytes
+//
+inline void lz_put32le(char* p, uint32_t v)
+{
+   p[0] = (char)v;
+   p[1] = (char)(v >> 8);
+   p[2] = (char)(v >> 16);
+   p[3] = (char)(v >> 24);
+} // end lz_put32le
+
+// ---------------------------------------------------- lz_get32le(const char*)
+// Loads a header field stored by lz_put32le( )
+//
+inline uint32_t lz_get32le(const char* p)
+{
+   const uint8_t* b = (const uint8_t*)p;
+   return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+} // end lz_get32le
+
+// ------------------------------------------------ lz_length(uint8_t*, size_t)
+// Writes the part of a literal or match length that did not fit its
+//   4-bit token field, as a run of 255s and a final byte
+//
+// return: One past the last byte written
+//
+inline uint8_t* lz_length(uint8_t* op, size_t len)
+{
+   while (len >= 255)
+   {
+      *op++ = 255;
+      len -= 255;
+   }
+   *op++ = (uint8_t)len;
+   return op;
+} // end lz_length
+
+// -------------------- lz_compress(const char*, size_t, char*, uint32_t*, int)
+// Compresses one block with a greedy hash-table match finder
+// Every four-byte sequence is hashed; a hit that really matches is
+//   extended and emitted, a miss moves on, taking larger steps the longer
+//   nothing matches (lower levels speed up sooner)
+//
+// param: src     Bytes being compressed
+// param: n       Number of bytes
+// param: dst     At least n + n / 255 + 16 bytes of output space
+// param: table   Match finder, 1 << LZ_HASHLOG entries
+// param: level   1 to LZ_MAXLEVEL
+//
+// return: Compressed size
+//
+size_t lz_compress(const char* src, size_t n, char* dst, uint32_t* table,
+   int level)
+{
+   const uint8_t* base = (const uint8_t*)src;
+   const uint8_t* ip = base;                 // Next byte to look at
+   const uint8_t* anchor = base;             // First literal not yet emitted
+   const uint8_t* end = base + n;
+   uint8_t* op = (uint8_t*)dst;
+
+   memset(table, 0, sizeof(uint32_t) << LZ_HASHLOG);
+   if (n >= LZ_MFLIMIT)
+   {
+      const uint8_t* mflimit = end - LZ_MFLIMIT;
+      const uint8_t* matchlimit = end - LZ_LASTLITERALS;
+      int shift = 3 + level;                 // Misses before the step grows
+      unsigned misses = 0;
+
+      while (ip <= mflimit)
+      {
+         uint32_t seq = lz_read32(ip);
+         uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASHLOG);
+         const uint8_t* cand = base + table[h];
+         table[h] = ip - base;
+
+         if (cand >= ip || ip - cand > LZ_MAXOFF || lz_read32(cand) != seq)
+         {
+            ip += 1 + (misses++ >> shift);
+            continue;
+         }
+
+         const uint8_t* m = ip + LZ_MINMATCH; // Extend the match
+         const uint8_t* c = cand + LZ_MINMATCH;
+         while (m < matchlimit && *m == *c)
+         {
+            m++;
+            c++;
+         }
+
+         size_t lit = ip - anchor;           // Emit literals, then the match
+         size_t mlen = (m - ip) - LZ_MINMATCH;
+         uint8_t* token = op++;
+         *token = (uint8_t)(((lit >= 15) ? 15 : lit) << 4);
+         if (lit >= 15)
+         {
+            op = lz_length(op, lit - 15);
+         }
+         memcpy(op, anchor, lit);
+         op += lit;
+         *op++ = (uint8_t)(ip - cand);
+         *op++ = (uint8_t)((ip - cand) >> 8);
+         *token |= (uint8_t)((mlen >= 15) ? 15 : mlen);
+         if (mlen >= 15)
+         {
+            op = lz_length(op, mlen - 15);
+         }
+
+         ip = m;
+         anchor = ip;
+         misses = 0;
+         if (level >= 5 && ip <= mflimit)    // Remember the match's tail too
+         {
+            table[(lz_read32(ip - 2) * 2654435761u) >> (32 - LZ_HASHLOG)] =
+               ip - 2 - base;
+         }
+      }
+   }
+
+   size_t lit = end - anchor;                // Last literals
+   uint8_t* token = op++;
+   *token = (uint8_t)(((lit >= 15) ? 15 : lit) << 4);
+   if (lit >= 15)
+   {
+      op = lz_length(op, lit - 15);
+   }
+   memcpy(op, anchor, lit);
+   op += lit;
+   return op - (uint8_t*)dst;
+} // end lz_compress
+
+// -------------------------- lz_decompress(const char*, size_t, char*, size_t)
+// Expands one block written by lz_compress( ), checking every length and
+//   offset so a corrupt block cannot write outside dst
+//
+// param: src     Compressed payload
+// param: n       Size of the payload
+// param: dst     Output space
+// param: cap     Size of the output space
+//
+// return: Uncompressed size, -1 if the block is corrupt
+//
+ssize_t lz_decompress(const char* src, size_t n, char* dst, size_t cap)
+{
+   const uint8_t* ip = (const uint8_t*)src;
+   const uint8_t* iend = ip + n;
+   uint8_t* op = (uint8_t*)dst;
+   uint8_t* oend = op + cap;
+
+   while (ip < iend)
+   {
+      unsigned token = *ip++;
+      size_t lit = token >> 4;
+      if (lit == 15)                         // Long literal run
+      {
+         unsigned b;
+         do
+         {
+            if (ip >= iend)
+            {
+               return -1;
+            }
+            b = *ip++;
+            lit += b;
+         } while (b == 255);
+      }
+      if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+      {
+         return -1;
+      }
+      memcpy(op, ip, lit);
+      op += lit;
+      ip += lit;
+      if (ip == iend)                        // Last sequence has no match
+      {
+         break;
+      }
+
+      if (iend - ip < 2)
+      {
+         return -1;
+      }
+      size_t off = ip[0] | (ip[1] << 8);
+      ip += 2;
+      size_t mlen = token & 15;
+      if (mlen == 15)                        // Long match
+      {
+         unsigned b;
+         do
+         {
+            if (ip >= iend)
+            {
+               return -1;
+            }
+            b = *ip++;
+            mlen += b;
+         } while (b == 255);
+      }
+      mlen += LZ_MINMATCH;
+      if (off == 0 || off > (size_t)(op - (uint8_t*)dst) ||
+         mlen > (size_t)(oend - op))
+      {
+         return -1;
+      }
+
+      const uint8_t* m = op - off;
+      if (off >= mlen)                       // Source and copy are apart
+      {
+         memcpy(op, m, mlen);
+         op += mlen;
+      }
+      else                                   // Overlap repeats a pattern
+      {
+         for (size_t i = 0; i < mlen; i++)
+         {
+            *op++ = *m++;
+         }
+      }
+   }
+   return op - (uint8_t*)dst;
+} // end lz_decompress
+
+// ---------------------------------------------- lz_allows(FILE*, int, size_t)
+// Checks a setvbuf( ) request against a compressed stream, which needs a
+//   buffer that one block header can describe
+//
+// return: true if the mode and size are usable
+//
+bool lz_allows(FILE* stream, int mode, size_t size)
+{
+   return stream->lz == NULL || ((mode == _IOFBF || mode == _IOLBF) &&
+      size <= LZ_MAXBLOCK);
+} // end lz_allows
+
+// ------------------------------------------------------------ lz_start(FILE*)
+// Turns a newly opened "r" or "w" stream into a compressed one with
+//   LZ_DEFBLOCK blocks at LZ_DEFLEVEL
+//
+// param: stream  Pointer to the file object just opened
+//
+// post:   stream->lz is set and the buffer is one block long
+//
+void lz_start(FILE* stream)
+{
+   setvbuf(stream, (char*)0, _IOFBF, LZ_DEFBLOCK);
+
+   lzstate* lz = new lzstate();
+   lz->level = LZ_DEFLEVEL;
+   if (stream->flag != O_RDONLY)
+   {
+      lz->table = new uint32_t[1 << LZ_HASHLOG];
+   }
+   stream->lz = lz;
+   stream->fsize = (stream->flag == O_RDONLY) ? -1 : 0; // Uncompressed size
+} // end lz_start
+
+// ------------------------------------------------------------- lz_stop(FILE*)
+// Frees a compressed stream's state, once its last block is written
+//
+void lz_stop(FILE* stream)
+{
+   lzstate* lz = stream->lz;
+
+   delete[] lz->table;
+   delete[] lz->scratch;
+   delete[] lz->boff;
+   delete[] lz->bpos;
+   delete lz;
+   stream->lz = NULL;
+} // end lz_stop
+
+// ----------------------------------------------- lz_scratch(lzstate*, size_t)
+// Makes sure the scratch buffer holds at least need bytes
+//
+// return: 0 on success
+//
+int lz_scratch(lzstate* lz, size_t need)
+{
+   if (lz->cap >= need)
+   {
+      return 0;
+   }
+   char* grown = new char[need];
+   delete[] lz->scratch;
+   lz->scratch = grown;
+   lz->cap = need;
+   return 0;
+} // end lz_scratch
+
+// ------------------------------------------------------------ lz_flush(FILE*)
+// Compresses the written part of the buffer into one block and writes
+//   its header and payload with a single gathered write
+// Called by fflush( ) in place of the plain write
+//
+// param: stream  Pointer to the compressed file object being flushed
+//
+// pre:    pos > 0 bytes of written data are in the buffer
+// return: 0 on success, -1 on error
+//
+int lz_flush(FILE* stream)
+{
+   lzstate* lz = stream->lz;
+   size_t raw = stream->pos;
+   const char* payload = stream->buffer;
+   size_t clen = raw;
+   uint32_t flags = LZ_STORED;
+
+   if (lz->level > 0 && lz_scratch(lz, raw + raw / 255 + 16) == 0)
+   {
+      size_t packed = lz_compress(stream->buffer, raw, lz->scratch, lz->table,
+         lz->level);
+      if (packed < raw)                      // Only keep it if it shrank
+      {
+         payload = lz->scratch;
+         clen = packed;
+         flags = 0;
+      }
+   }
+
+   char hdr[LZ_HDRSIZE];
+   lz_put32le(hdr, clen | flags);
+   lz_put32le(hdr + 4, raw);
+   struct iovec iov[2];
+   iov[0].iov_base = hdr;
+   iov[0].iov_len = LZ_HDRSIZE;
+   iov[1].iov_base = (void*)payload;
+   iov[1].iov_len = clen;
+   return (io_writevall(stream, iov, 2) == (ssize_t)(LZ_HDRSIZE + clen))
+      ? 0 : -1;
+} // end lz_flush
+
+// ----------------------------------- lz_preadall(FILE*, char*, size_t, off_t)
+// pread( )s n bytes, retrying on short reads
+//
+// return: Bytes read, less than n only at end of file or on error
+//
+size_t lz_preadall(FILE* stream, char* buf, size_t n, off_t off)
+{
+   size_t done = 0;
+
+   while (done < n)
+   {
+      ssize_t got = io_pread(stream, buf + done, n - done, off + done);
+      if (got <= 0)
+      {
+         break;
+      }
+      done += got;
+   }
+   return done;
+} // end lz_preadall
+
+// ----------------------------------------------- lz_header(FILE*, off_t, ...)
+// Reads the block header at a file offset and adds the block to the
+//   index if it is the next one not yet indexed
+//
+// param: stream  Pointer to the compressed file object
+// param: foff    File offset of the header
+// param: lpos    Stream offset of the block
+// param: clen    Set to the payload length, LZ_STORED flag removed
+// param: raw     Set to the uncompressed length
+// param: stored  Set if the payload is not compressed
+//
+// return: 1 if a block was found, 0 at end of file, -1 if corrupt
+//
+int lz_header(FILE* stream, off_t foff, off_t lpos, size_t* clen, size_t* raw,
+   bool* stored)
+{
+   lzstate* lz = stream->lz;
+   char hdr[LZ_HDRSIZE];
+
+   size_t got = lz_preadall(stream, hdr, LZ_HDRSIZE, foff);
+   if (got == 0)
+   {
+      if (foff == lz->scanoff)               // Index reaches the end
+      {
+         lz->complete = true;
+         stream->fsize = lz->scanpos;
+      }
+      return 0;
+   }
+   if (got < LZ_HDRSIZE)
+   {
+      return -1;
+   }
+
+   uint32_t word = lz_get32le(hdr);
+   *stored = (word & LZ_STORED) != 0;
+   *clen = word & ~LZ_STORED;
+   *raw = lz_get32le(hdr + 4);
+   if (*raw > LZ_MAXBLOCK || (*stored && *clen != *raw))
+   {
+      return -1;
+   }
+
+   if (foff == lz->scanoff && !lz->complete) // Next unindexed block
+   {
+      if (lz->count == lz->room)
+      {
+         size_t room = (lz->room > 0) ? lz->room * 2 : 64;
+         off_t* boff = new off_t[room];
+         off_t* bpos = new off_t[room];
+         if (lz->count > 0)                  // First growth has no index
+         {
+            memcpy(boff, lz->boff, lz->count * sizeof(off_t));
+            memcpy(bpos, lz->bpos, lz->count * sizeof(off_t));
+         }
+         delete[] lz->boff;
+         delete[] lz->bpos;
+         lz->boff = boff;
+         lz->bpos = bpos;
+         lz->room = room;
+      }
+      lz->boff[lz->count] = foff;
+      lz->bpos[lz->count++] = lpos;
+      lz->scanoff = foff + LZ_HDRSIZE + *clen;
+      lz->scanpos = lpos + *raw;
+   }
+   return 1;
+} // end lz_header
+
+// ----------------------------------------------------------- lz_refill(FILE*)
+// Refills the buffer of a compressed stream with the next block
+// A block larger than a pooled buffer replaces it with a bigger one
+//
+// param: stream  Pointer to the compressed file object
+//
+// post:   actual_size holds the block's length, 0 at end of file and
+//           -1 on error; pos skips any bytes an fpurge( ) or fseek( )
+//           left behind in it
+//
+void lz_refill(FILE* stream)
+{
+   lzstate* lz = stream->lz;
+   size_t clen, raw;
+   bool stored;
+
+   STAT_ADD(stream, refills, 1);
+   stream->pos = 0;
+   int found = lz_header(stream, lz->foff, lz->lnext, &clen, &raw, &stored);
+   if (found == 0)                           // No more blocks
+   {
+      stream->actual_size = 0;
+      stream->eof = true;
+      return;
+   }
+   if (found == -1)
+   {
+      printf("Corrupt compressed block\n");
+      stream->actual_size = -1;
+      return;
+   }
+
+   if (raw > (size_t)stream->size)           // Block outgrew the buffer
+   {
+      size_t want = raw;
+      char* bigger = stream->bufown ? bufpool_get(&want) : NULL;
+      if (bigger == NULL)
+      {
+         printf("Compressed block larger than the buffer\n");
+         stream->actual_size = -1;
+         return;
+      }
+      bufpool_put(stream->buffer, stream->size);
+      stream->buffer = bigger;
+      stream->size = want;
+   }
+
+   off_t at = lz->foff + LZ_HDRSIZE;
+   ssize_t got;
+   if (stored)                               // Straight into the buffer
+   {
+      got = (lz_preadall(stream, stream->buffer, raw, at) == raw) ? raw : -1;
+   }
+   else if (lz_scratch(lz, clen) == -1 ||
+      lz_preadall(stream, lz->scratch, clen, at) != clen)
+   {
+      got = -1;
+   }
+   else
+   {
+      got = lz_decompress(lz->scratch, clen, stream->buffer, raw);
+   }
+   if (got != (ssize_t)raw)
+   {
+      printf("Corrupt compressed block\n");
+      stream->actual_size = -1;
+      return;
+   }
+
+   lz->cur = lz->foff;
+   lz->curpos = lz->lnext;
+   lz->foff = at + clen;
+   lz->lnext += raw;
+   stream->actual_size = raw;
+   stream->pos = (lz->skip < raw) ? lz->skip : raw;
+   lz->skip = 0;
+   stream->eof = false;
+} // end lz_refill
+
+// ----------------------------------------------------- lz_index(FILE*, off_t)
+// Extends the block index by reading headers only, until it covers a
+//   stream offset or, for a negative target, the whole file
+// The uncompressed file size is known once the index is complete
+//
+// param: stream  Pointer to the compressed file object
+// param: target  Stream offset the index must reach, -1 for all of it
+//
+// return: 0 on success, -1 if a header is corrupt
+//
+int lz_index(FILE* stream, off_t target)
+{
+   lzstate* lz = stream->lz;
+   size_t clen, raw;
+   bool stored;
+
+   while (!lz->complete && (target < 0 || lz->scanpos <= target))
+   {
+      if (lz_header(stream, lz->scanoff, lz->scanpos, &clen, &raw,
+         &stored) == -1)
+      {
+         printf("Corrupt compressed block\n");
+         return -1;
+      }
+   }
+   return 0;
+} // end lz_index
+
+// ------------------------------------------------------ lz_seek(FILE*, off_t)
+// Moves a compressed reader to a stream offset
+// The block holding the target is found in the index by binary search
+//   and is decompressed by the next refill( ), which skips to the target
+//
+// param: stream  Pointer to the compressed file object
+// param: target  Stream offset to move to
+//
+// return: 0 on success, -1 on error
+//
+int lz_seek(FILE* stream, off_t target)
+{
+   lzstate* lz = stream->lz;
+
+   if (stream->flag != O_RDONLY)             // Writers only append blocks
+   {
+      if (target == stream->fpos)
+      {
+         return 0;
+      }
+      printf("Compressed streams only seek when reading\n");
+      return -1;
+   }
+
+   if (lz_index(stream, target) == -1)
+   {
+      return -1;
+   }
+
+   size_t lo = 0, hi = lz->count;            // Last block starting <= target
+   while (lo < hi)
+   {
+      size_t mid = (lo + hi) / 2;
+      if (lz->bpos[mid] <= target)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   if (lo == 0 || target >= lz->scanpos)     // Empty file or past the end
+   {
+      lz->foff = lz->scanoff;
+      lz->lnext = lz->scanpos;
+      lz->skip = 0;
+   }
+   else
+   {
+      lz->foff = lz->boff[lo - 1];
+      lz->lnext = lz->bpos[lo - 1];
+      lz->skip = target - lz->bpos[lo - 1];
+   }
+
+   stream->fpos = target;
+   stream->pos = 0;
+   stream->actual_size = 0;
+   stream->lastop = 0;
+   stream->eof = (lz->complete && target >= stream->fsize);
+   return 0;
+} // end lz_seek
+
+// Page cache bypass for streams opened with the 'd' mode modifier
+// The descriptor is opened O_DIRECT, so every transfer must start at a
+//   DIO_ALIGN file offset, be a multiple of DIO_ALIGN long and use a
+//   DIO_ALIGN-aligned buffer; pooled buffers already are
+// All direct I/O is positional: buffer[0] always holds the file offset
+//   fpos - pos, which is kept aligned, and the descriptor offset is unused
+// A flush or purge keeps the last partial block at the front of the
+//   buffer, so the next flush can write that block whole
+// Only the unaligned ends of a flush, such as the last bytes of the file
+//   written by fclose( ), go through the page cache
+#define DIO_ALIGN 4096              // Logical block size assumed for O_DIRECT
+
+// -------------------------------------- dio_allows(FILE*, char*, int, size_t)
+// Checks a setvbuf( ) request against a direct stream, which needs a
+//   size that is a whole number of blocks and, if given, an aligned buffer
+//
+// return: true if the buffer and mode are usable
+//
+bool dio_allows(FILE* stream, char* buf, int mode, size_t size)
+{
+   if (!stream->direct)
+   {
+      return true;
+   }
+   if (mode != _IOFBF && mode != _IOLBF)
+   {
+      return false;
+   }
+   if (size % DIO_ALIGN != 0)                // 0 picks BUFSIZ, also whole
+   {
+      return false;
+   }
+   return buf == (char*)0 || ((uintptr_t)buf % DIO_ALIGN == 0 && size > 0);
+} // end dio_allows
+
+// ---------------------------------------------------------- dio_refill(FILE*)
+// Refills the buffer of a direct stream with the aligned blocks holding
+//   fpos, and skips to fpos within them
+//
+// param: stream  Pointer to the direct file object
+//
+// post:   actual_size holds the bytes read, -1 on error, and pos is fpos's
+//           place in the buffer (actual_size if fpos is past the end)
+//
+void dio_refill(FILE* stream)
+{
+   STAT_ADD(stream, refills, 1);
+   adapt_refill(stream);                     // Resize to the access pattern
+
+   off_t base = stream->fpos & ~(off_t)(DIO_ALIGN - 1);
+   ssize_t skip = stream->fpos - base;
+   stream->actual_size = io_pread(stream, stream->buffer, stream->size, base);
+   stream->dhead = 0;
+   if (stream->actual_size == -1)
+   {
+      printf("Error in reading file\n");
+      stream->pos = 0;
+      return;
+   }
+   stream->pos = (skip < stream->actual_size) ? skip : stream->actual_size;
+   if (stream->actual_size < stream->size)
+   {
+      stream->eof = true;                    // Short read, as refill( )
+   }
+} // end dio_refill
+
+// --------------------------- dio_pwriteall(FILE*, const char*, size_t, off_t)
+// pwrite( )s n bytes, retrying on short writes
+//
+// return: 0 on success, -1 on error
+//
+int dio_pwriteall(FILE* stream, const char* buf, size_t n, off_t off)
+{
+   size_t done = 0;
+
+   while (done < n)
+   {
+      ssize_t put = io_pwrite(stream, buf + done, n - done, off + done);
+      if (put <= 0)
+      {
+         return -1;
+      }
+      done += put;
+   }
+   return 0;
+} // end dio_pwriteall
+
+// ----------------------------------------------------------- dio_flush(FILE*)
+// Writes the buffered data of a direct stream, bytes dhead to pos
+// Whole blocks are written with O_DIRECT; the partial blocks at either
+//   end are written with O_DIRECT turned off for the one call, so the
+//   file bytes around them are left alone
+// Called by fflush( ) in place of the plain write
+//
+// param: stream  Pointer to the direct file object being flushed
+//
+// pre:    pos > dhead bytes of written data are in the buffer
+// return: 0 on success, -1 on error
+//
+int dio_flush(FILE* stream)
+{
+   off_t base = stream->fpos - stream->pos;  // File offset of buffer[0]
+   ssize_t head = stream->dhead;             // First byte to write
+   ssize_t first = (head + DIO_ALIGN - 1) & ~(ssize_t)(DIO_ALIGN - 1);
+   ssize_t last = stream->pos & ~(ssize_t)(DIO_ALIGN - 1);
+   if (first > stream->pos)                  // All inside one block
+   {
+      first = stream->pos;
+   }
+   if (last < first)
+   {
+      last = first;
+   }
+
+   int result = 0;                           // Whole blocks [first, last)
+   if (last > first && dio_pwriteall(stream, stream->buffer + first,
+      last - first, base + first) == -1)
+   {
+      result = -1;
+   }
+   if (result == 0 && (first > head || stream->pos > last))
+   {                                         // Ends [head, first), [last, pos)
+      int fl = fcntl(stream->fd, F_GETFL);
+      fcntl(stream->fd, F_SETFL, fl & ~O_DIRECT);
+      if (first > head && dio_pwriteall(stream, stream->buffer + head,
+         first - head, base + head) == -1)
+      {
+         result = -1;
+      }
+      if (result == 0 && stream->pos > last && dio_pwriteall(stream,
+         stream->buffer + last, stream->pos - last, base + last) == -1)
+      {
+         result = -1;
+      }
+      fcntl(stream->fd, F_SETFL, fl);
+   }
+   if (stream->ds != NULL && result == 0)    // Count toward durability
+   {
+      dsync_note(stream, stream->pos - head);
+   }
+   return result;
+} // end dio_flush
+
+// ----------------------------------------------------------- dio_purge(FILE*)
+// Empties the buffer of a direct stream except for the partial block
+//   holding fpos, which moves to the front so buffer[0] stays aligned
+// The kept bytes count as already consumed: pos and actual_size both
+//   point past them
+//
+// param: stream  Pointer to the direct file object being purged
+//
+void dio_purge(FILE* stream)
+{
+   ssize_t whole = stream->pos & ~(ssize_t)(DIO_ALIGN - 1);
+   ssize_t tail = stream->pos - whole;       // Bytes of the partial block
+
+   if (whole > 0)
+   {
+      memmove(stream->buffer, stream->buffer + whole, tail);
+   }
+   stream->dhead = (stream->dhead > whole) ? stream->dhead - whole : 0;
+   stream->pos = tail;
+   stream->actual_size = tail;
+   stream->lastop = 0;
+} // end dio_purge
+
+// ----------------------------------------------------- fpurge_unlocked(FILE*)
+// This method wipes the data in the file buffer by replacing every element
+//   that held read or written data with '\0'
+// Only that part is touched, so purging a very large buffer stays cheap
+// The file buffer's position and actual size are reset to 0
+// The caller must hold the stream lock, see flockfile( )
+// 
+// param: stream  Pointer to the file object whose buffer is being cleared
+// 
+// pre:    The file has been initialized an opened
+// post:   File buffer is refilled with \0, actual size & position are reset
+// return: 0 on success, -1 on error
+//
+int fpurge_unlocked(FILE* stream)
+{
+   if (stream == nullptr)                    // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (stream->mode == _IONBF)               // No-buffer check
+   {
+      return -1;
+   }
+   if (stream->mapped)                       // Mapping is the file itself
+   {
+      stream->lastop = 0;
+      return 0;
+   }
+
+   STAT_ADD(stream, purges, 1);
+   if (stream->ra != NULL)                   // Settle background reads
+   {
+      ra_sync(stream);
+   }
+   if (stream->direct)                       // Keep the partial block
+   {
+      dio_purge(stream);
+      return 0;
+   }
+   if (stream->lz != NULL && stream->lastop == 'r' &&
+      stream->actual_size > stream->pos)     // Decompress this block again
+   {
+      stream->lz->foff = stream->lz->cur;
+      stream->lz->lnext = stream->lz->curpos;
+      stream->lz->skip = stream->pos;
+   }
+   else if (stream->lastop == 'r' && stream->actual_size > stream->pos)
+   {                                         // Backtrack over unread buffer
+      stream->fpos = io_lseek(stream, stream->pos - stream->actual_size,
+         SEEK_CUR);
+   }
+
+   ssize_t used = (stream->actual_size > stream->pos) ? stream->actual_size
+      : stream->pos;                         // Only the part that held data
+   if (used > 0)
+   {
+      memset(stream->buffer, '\0', used);    // Replace with '\0'
+   }
+
+   stream->pos = 0;                          // Reset position & actual size
+   stream->actual_size = 0;
+   stream->lastop = 0;
+   return 0;
+} // end fpurge_unlocked
+
+// -------------------------------------------------------------- fpurge(FILE*)
+// Locks the stream around fpurge_unlocked( )
+//
+int fpurge(FILE* stream)
+{
+   flockfile(stream);
+   int result = fpurge_unlocked(stream);
+   funlockfile(stream);
+   return result;
+} // end fpurge
+
+// ----------------------------------------- writeall(int, const char*, size_t)
+// Writes a block of memory to a file descriptor, retrying on short writes
+//
+// param: fd      File descriptor being written to
+// param: buf     Start of the memory to write
+// param: len     Number of bytes to write
+//
+// pre:    fd is open for writing
+// post:   All len bytes are written unless write() reports an error
+// return: Number of bytes written, -1 if nothing could be written
+//
+ssize_t writeall(int fd, const char* buf, size_t len)
+{
+   size_t done = 0;                          // Bytes written so far
+
+   while (done < len)
+   {
+      ssize_t n = write(fd, buf + done, len - done);
+      if (n <= 0)                            // write() returns -1 on error
+      {
+         return (done > 0) ? (ssize_t)done : -1;
+      }
+      done += n;
+   }
+   return done;
+} // end writeall
+
+// ----------------------------------------------------- fflush_unlocked(FILE*)
+// This method prints what remains in the buffer to the file
+// Buffer is then purged
+// Written data already advanced fpos when it was buffered, so only the
+//   file descriptor moves here
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object whose buffer is being flushed
+//
+// pre:    The file has been initialized an opened
+// post:   Remaining file buffer is written and purged
+// return: 0 on success, -1 on error
+//
+int fflush_unlocked(FILE* stream)
+{
+   if (stream == nullptr)                    // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (stream->astale)                       // Appends moved the end
+   {
+      stream->fsize = -1;
+   }
+   else if (stream->lastop == 'w' && stream->fsize != -1 &&
+      stream->fpos > stream->fsize)          // Writes grew the file
+   {
+      stream->fsize = stream->fpos;
+   }
+   if (stream->mode == _IONBF)               // No-buffer check
+   {
+      return -1;
+   }
+
+   int result = 0;
+   if (stream->lastop == 'w' && stream->pos > 0) // Only written data is output
+   {
+      STAT_ADD(stream, flushes, 1);
+      stream->actual_size = stream->pos;
+      int put;
+      if (stream->lz != NULL)                // One compressed block
+      {
+         put = lz_flush(stream);
+      }
+      else if (stream->direct)               // Aligned blocks
+      {
+         put = dio_flush(stream);
+      }
+      else
+      {
+         put = (io_writeall(stream, stream->buffer, stream->actual_size) ==
+            stream->actual_size) ? 0 : -1;
+      }
+      if (put == -1)
+      {
+         printf("Error in writing file\n");
+         result = -1;
+      }
+   }
+
+   fpurge_unlocked(stream);
+   if (stream->dirtysince != 0)              // Nothing left to go stale
+   {
+      __atomic_store_n(&stream->dirtysince, 0, __ATOMIC_RELAXED);
+   }
+   return result;
+} // end fflush_unlocked
+
+// -------------------------------------------------------------- fflush(FILE*)
+// Locks the stream around fflush_unlocked( )
+//
+int fflush(FILE* stream)
+{
+   if (stream == nullptr)                    // Every open stream
+   {
+      return fflushall();
+   }
+   flockfile(stream);
+   int result = fflush_unlocked(stream);
+   funlockfile(stream);
+   return result;
+} // end fflush
+
+// --------------------------------------------------- flushline(FILE*, size_t)
+// Line buffering for a write of n bytes that has just been buffered
+// If the write held a newline, everything up to and including the last
+//   one is written with one call; the unfinished line stays buffered
+// Compressed and direct streams flush the whole buffer instead
+//
+// param: stream  Pointer to the file object just written to
+// param: n       Bytes the write added, the only ones scanned
+//
+// return: 0 on success, -1 on error
+//
+int flushline(FILE* stream, size_t n)
+{
+   if (stream->mode != _IOLBF || stream->lastop != 'w' || stream->pos == 0)
+   {
+      return 0;
+   }
+
+   size_t scan = ((size_t)stream->pos < n) ? stream->pos : n;
+   const char* nl = scanrchr(stream->buffer + stream->pos - scan, scan, '\n');
+   if (nl == NULL)                           // Line not finished yet
+   {
+      return 0;
+   }
+   ssize_t upto = nl + 1 - stream->buffer;   // Bytes of complete lines
+   if (upto == stream->pos || stream->lz != NULL || stream->direct)
+   {
+      return fflush_unlocked(stream);
+   }
+
+   STAT_ADD(stream, flushes, 1);
+   if (io_writeall(stream, stream->buffer, upto) != upto)
+   {
+      printf("Error in writing file\n");
+      return -1;
+   }
+   memmove(stream->buffer, stream->buffer + upto, stream->pos - upto);
+   stream->pos -= upto;
+   off_t end = stream->fpos - stream->pos;   // File offset now written to
+   if (!stream->astale && stream->fsize != -1 && end > stream->fsize)
+   {
+      stream->fsize = end;
+   }
+   return 0;
+} // end flushline
+
+// Durability state for a stream configured by setdurability( )
+// The policy picks when written data is forced to disk:
+//   _DSYNC_NONE      the kernel writes it back whenever it likes
+//   _DSYNC_PERIODIC  fdatasync( ) once every nbytes written or msec
+//                    elapsed, checked as writes reach the descriptor
+//   _DSYNC_GROUP     nothing is synced until fcommit( ); callers that
+//                    commit while an fdatasync( ) is running wait for it
+//                    and share the next one, so N committers cost about
+//                    two syncs instead of N
+// Bytes are counted as they are handed to the kernel, so a sync that
+//   starts after a count was taken covers every one of those bytes
+struct dsyncstate
+{
+   int policy;                     // _DSYNC_NONE, _PERIODIC or _GROUP
+   size_t every;                   // Periodic: bytes between syncs, 0 = off
+   int msec;                       // Periodic: ms between syncs, 0 = off
+   size_t unsynced;                // Periodic: bytes since the last sync
+   uint64_t lastsync;              // Periodic: time of the last sync, ms
+   unsigned long long written;     // Bytes handed to the kernel so far
+   unsigned long long synced;      // Bytes known to be on disk
+   bool syncing;                   // Group: an fdatasync( ) is running
+   pthread_mutex_t lock;           // Guards the counters above
+   pthread_cond_t done;            // Signalled when a group sync ends
+};
+
+// --------------------------------------------------------------- dsync_now( )
+// Returns a monotonic timestamp in milliseconds
+//
+uint64_t dsync_now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+} // end dsync_now
+
+// -------------------------------------------------- dsync_note(FILE*, size_t)
+// Counts bytes that reached the descriptor and applies a periodic policy
+// Called by the io_write wrappers of streams with a durability policy
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object that was written
+// param: n       Number of bytes the kernel accepted
+//
+// post:   The data is synced if a periodic limit was reached
+//
+void dsync_note(FILE* stream, size_t n)
+{
+   dsyncstate* ds = stream->ds;
+
+   pthread_mutex_lock(&ds->lock);
+   ds->written += n;
+   unsigned long long mark = ds->written;
+   pthread_mutex_unlock(&ds->lock);
+
+   if (ds->policy != _DSYNC_PERIODIC)        // Only periodic syncs here
+   {
+      return;
+   }
+   ds->unsynced += n;
+   uint64_t now = (ds->msec > 0) ? dsync_now() : 0;
+   if ((ds->every > 0 && ds->unsynced >= ds->every) ||
+      (ds->msec > 0 && now - ds->lastsync >= (uint64_t)ds->msec))
+   {
+      if (fdatasync(stream->fd) == -1)
+      {
+         printf("Error in syncing file\n");
+         return;
+      }
+      ds->unsynced = 0;
+      ds->lastsync = (ds->msec > 0) ? now : 0;
+      pthread_mutex_lock(&ds->lock);
+      if (mark > ds->synced)
+      {
+         ds->synced = mark;
+      }
+      pthread_mutex_unlock(&ds->lock);
+   }
+} // end dsync_note
+
+// ------------------------------------- setdurability(FILE*, int, size_t, int)
+// Chooses when the stream's written data is forced to disk
+// Takes effect for data written from now on, pending data is not flushed
+//
+// param: stream  Pointer to the file object being configured
+// param: policy  _DSYNC_NONE, _DSYNC_PERIODIC or _DSYNC_GROUP
+// param: nbytes  Periodic: sync after this many bytes, 0 for no limit
+// param: msec    Periodic: sync once this many ms have passed, 0 for none
+//
+// pre:    The file has been opened for writing
+// post:   The policy is applied to later writes and fcommit( )s
+// return: 0 on success, -1 on error
+//
+int setdurability(FILE* stream, int policy, size_t nbytes, int msec)
+{
+   if (stream == nullptr)                    // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (policy != _DSYNC_NONE && policy != _DSYNC_PERIODIC &&
+      policy != _DSYNC_GROUP)
+   {
+      printf("Invalid durability policy");
+      return -1;
+   }
+   if (policy == _DSYNC_PERIODIC && (msec < 0 || (nbytes == 0 && msec == 0)))
+   {
+      printf("Invalid durability interval");
+      return -1;
+   }
+
+   flockfile(stream);
+   if (stream->ds == NULL)                   // First policy on this stream
+   {
+      if (policy == _DSYNC_NONE)
+      {
+         funlockfile(stream);
+         return 0;
+      }
+      stream->ds = new dsyncstate();
+      pthread_mutex_init(&stream->ds->lock, NULL);
+      pthread_cond_init(&stream->ds->done, NULL);
+   }
+
+   dsyncstate* ds = stream->ds;
+   ds->policy = policy;
+   ds->every = nbytes;
+   ds->msec = msec;
+   ds->unsynced = 0;
+   ds->lastsync = dsync_now();
+   funlockfile(stream);
+   return 0;
+} // end setdurability
+
+// ------------------------------------------------------------- fcommit(FILE*)
+// Flushes the stream and waits until everything written so far is on disk
+// Under _DSYNC_GROUP the fdatasync( ) runs without the stream lock, so
+//   other threads keep writing; committers that arrive meanwhile wait for
+//   it and then share a single sync covering all of their data
+// Other policies simply fdatasync( ) after the flush
+//
+// param: stream  Pointer to the file object being committed
+//
+// pre:    The file has been opened for writing
+// post:   Data written before the call is durable
+// return: 0 on success, -1 on error
+//
+int fcommit(FILE* stream)
+{
+   if (stream == nullptr)                    // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+
+   flockfile(stream);
+   if (stream->lastop == 'w' && stream->mode != _IONBF &&
+      fflush_unlocked(stream) == -1)         // Hand pending data to the kernel
+   {
+      funlockfile(stream);
+      return -1;
+   }
+
+   dsyncstate* ds = stream->ds;
+   if (ds == NULL || ds->policy != _DSYNC_GROUP) // Sync on our own
+   {
+      int result = fdatasync(stream->fd);
+      if (result == 0 && ds != NULL)
+      {
+         ds->unsynced = 0;
+         ds->lastsync = dsync_now();
+         pthread_mutex_lock(&ds->lock);
+         ds->synced = ds->written;
+         pthread_mutex_unlock(&ds->lock);
+      }
+      funlockfile(stream);
+      return result;
+   }
+
+   pthread_mutex_lock(&ds->lock);
+   unsigned long long target = ds->written;  // Our data ends here
+   funlockfile(stream);                      // Let writers carry on
+
+   int result = 0;
+   while (ds->synced < target)
+   {
+      if (ds->syncing)                       // Ride along with the next one
+      {
+         pthread_cond_wait(&ds->done, &ds->lock);
+         continue;
+      }
+
+      ds->syncing = true;                    // Lead a sync for everyone
+      unsigned long long mark = ds->written;
+      pthread_mutex_unlock(&ds->lock);
+      result = fdatasync(stream->fd);
+      pthread_mutex_lock(&ds->lock);
+      ds->syncing = false;
+      if (result == 0 && mark > ds->synced)
+      {
+         ds->synced = mark;
+      }
+      pthread_cond_broadcast(&ds->done);
+      if (result == -1)
+      {
+         printf("Error in syncing file\n");
+         break;
+      }
+   }
+   pthread_mutex_unlock(&ds->lock);
+   return result;
+} // end fcommit
+
+// -------------------------------------------- setcompress(FILE*, size_t, int)
+// Chooses the block size and compression level of a compressed writer
+// Data already written is flushed as a block first
+//
+// param: stream    Pointer to a file object opened with "wz"
+// param: blocksize Uncompressed bytes per block, up to 1 GB; 0 keeps it
+// param: level     0 stores blocks as they are, 1 (fastest) to 9
+//
+// pre:    The file has been opened with the 'z' modifier for writing
+// return: 0 on success, -1 on error
+//
+int setcompress(FILE* stream, size_t blocksize, int level)
+{
+   if (stream == nullptr)                    // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (stream->lz == NULL || stream->flag == O_RDONLY)
+   {
+      printf("Not a compressed writer\n");
+      return -1;
+   }
+   if (level < 0 || level > LZ_MAXLEVEL || blocksize > LZ_MAXBLOCK)
+   {
+      printf("Invalid compression parameter\n");
+      return -1;
+   }
+
+   flockfile(stream);
+   int result = 0;
+   if (stream->lastop == 'w')                // Finish the current block
+   {
+      result = fflush_unlocked(stream);
+   }
+   if (result == 0 && blocksize > 0)
+   {
+      result = setvbuf(stream, (char*)0, _IOFBF, blocksize);
+   }
+   stream->lz->level = level;
+   funlockfile(stream);
+   return result;
+} // end setcompress
+
+// Open streams and the background flusher
+// fopen( ) adds every stream to one list and fclose( ) removes it
+// fflush(NULL) and the exit flush write out every stream holding
+//   written data; setflushdelay( ) starts a thread that also flushes any
+//   stream whose data has waited longer than a delay, so readers of the
+//   file see it in bounded time while writers keep full-buffer batches
+// Writes stamp dirtysince when they dirty an empty buffer, and only
+//   while the flusher runs; starting the flusher stamps the buffers
+//   already dirty, and fflush( ) clears it
+static pthread_mutex_t flushlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flushwake = PTHREAD_COND_INITIALIZER;
+static pthread_t flushthread;               // Background flusher
+static int flushdelay = 0;                  // Milliseconds, 0 when stopped
+static int flushgen = 0;                    // Bumped when a thread must exit
+static bool flushrunning = false;           // flushthread needs a join
+
+// ----------------------------------------------------------- markdirty(FILE*)
+// Stamps the time a stream's buffer started holding unflushed data
+// Called after a write leaves data in the buffer
+//
+inline void markdirty(FILE* stream)
+{
+   if (stream->dirtysince == 0 &&
+      __atomic_load_n(&flushdelay, __ATOMIC_RELAXED) > 0)
+   {
+      __atomic_store_n(&stream->dirtysince, dsync_now(), __ATOMIC_RELAXED);
+   }
+} // end markdirty
+
+// --------------------------------------------------------------- fflushall( )
+// Flushes every open stream holding written data, as fflush(NULL)
+// Streams being read are left alone
+// The list lock is held while walking, so stream locks are only tried:
+//   a thread holding its stream lock may be in fopen( ) waiting for the
+//   list; streams found busy are retried after the list is let go
+//
+// return: 0 on success, -1 if any flush failed
+//
+int fflushall()
+{
+   int result = 0;
+   bool busy = true;                         // Some stream still to flush
+
+   while (busy)
+   {
+      busy = false;
+      pthread_mutex_lock(&streamlock);
+      for (FILE* stream = openstreams; stream != NULL; stream = stream->next)
+      {
+         if (ftrylockfile(stream) != 0)      // Owner busy, next round
+         {
+            busy = true;
+            continue;
+         }
+         if (stream->lastop == 'w' && fflush_unlocked(stream) == -1)
+         {
+            result = -1;
+         }
+         funlockfile(stream);
+      }
+      pthread_mutex_unlock(&streamlock);
+      if (busy)
+      {
+         sched_yield();                      // Let the owners get on
+      }
+   }
+   return result;
+} // end fflushall
+
+// --------------------------------------------------------- flushall_atexit( )
+// Exit handler: stops the flusher and writes out every stream
+// Stream locks are not taken, as a thread still running at exit may hold
+//   one for good
+//
+void flushall_atexit()
+{
+   setflushdelay(0);
+   pthread_mutex_lock(&streamlock);
+   for (FILE* stream = openstreams; stream != NULL; stream = stream->next)
+   {
+      if (stream->lastop == 'w')
+      {
+         fflush_unlocked(stream);
+      }
+   }
+   pthread_mutex_unlock(&streamlock);
+} // end flushall_atexit
+
+// ---------------------------------------------------------- flushall_setup( )
+// Registers the exit flush, once, when the first stream is opened
+//
+void flushall_setup()
+{
+   atexit(flushall_atexit);
+} // end flushall_setup
+
+// ------------------------------------------------------- flushstale(uint64_t)
+// Flushes every stream whose data has waited at least delay milliseconds
+// Streams locked by their owner are skipped until the next pass
+//
+void flushstale(uint64_t delay)
+{
+   uint64_t now = dsync_now();
+
+   pthread_mutex_lock(&streamlock);
+   for (FILE* stream = openstreams; stream != NULL; stream = stream->next)
+   {
+      uint64_t since = __atomic_load_n(&stream->dirtysince, __ATOMIC_RELAXED);
+      if (since == 0 || now - since < delay || ftrylockfile(stream) != 0)
+      {
+         continue;
+      }
+      if (stream->lastop == 'w' && stream->dirtysince != 0)
+      {
+         fflush_unlocked(stream);
+      }
+      else if (stream->dirtysince != 0)      // Stamped while busy, now clean
+      {
+         __atomic_store_n(&stream->dirtysince, 0, __ATOMIC_RELAXED);
+      }
+      funlockfile(stream);
+   }
+   pthread_mutex_unlock(&streamlock);
+} // end flushstale
+
+// ------------------------------------------------------------- markdirtyall()
+// Stamps every stream already holding written data, so data buffered
+//   before the flusher started is timed from the start
+// Streams locked by their owner are stamped unchecked; flushstale( )
+//   drops a stamp that turns out to cover no written data
+//
+void markdirtyall()
+{
+   pthread_mutex_lock(&streamlock);
+   for (FILE* stream = openstreams; stream != NULL; stream = stream->next)
+   {
+      if (ftrylockfile(stream) != 0)         // Never wait under the list lock
+      {
+         markdirty(stream);
+         continue;
+      }
+      if (stream->lastop == 'w' && stream->pos > 0)
+      {
+         markdirty(stream);
+      }
+      funlockfile(stream);
+   }
+   pthread_mutex_unlock(&streamlock);
+} // end markdirtyall
+
+// -------------------------------------------------------- flusher_main(void*)
+// Flusher thread body: wakes four times per delay and flushes stale
+//   streams, so no data waits much longer than the delay
+//
+// param: arg     Generation the thread was started for
+//
+void* flusher_main(void* arg)
+{
+   int gen = (int)(intptr_t)arg;
+
+   pthread_mutex_lock(&flushlock);
+   while (flushgen == gen && flushdelay > 0)
+   {
+      int delay = flushdelay;
+      int step = (delay >= 4) ? delay / 4 : 1;
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += step / 1000;
+      until.tv_nsec += (long)(step % 1000) * 1000000;
+      if (until.tv_nsec >= 1000000000)
+      {
+         until.tv_sec++;
+         until.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&flushwake, &flushlock, &until);
+      if (flushgen != gen || flushdelay == 0)
+      {
+         break;
+      }
+
+      pthread_mutex_unlock(&flushlock);
+      flushstale(delay);
+      pthread_mutex_lock(&flushlock);
+   }
+   pthread_mutex_unlock(&flushlock);
+   return NULL;
+} // end flusher_main
+
+// --------------------------------------------------------- setflushdelay(int)
+// Bounds how long written data may wait in any stream's buffer
+// A background thread flushes each stream whose buffer has held data for
+//   msec milliseconds; buffers that fill sooner are flushed as usual
+//
+// param: msec    Longest wait in milliseconds, 0 stops the thread
+//
+// return: 0 on success, -1 on error
+//
+int setflushdelay(int msec)
+{
+   if (msec < 0)                             // Parameter validation
+   {
+      printf("Invalid flush delay\n");
+      return -1;
+   }
+
+   pthread_mutex_lock(&flushlock);
+   flushdelay = msec;
+   bool join = false;
+   bool started = false;
+   pthread_t old = flushthread;
+   if (msec == 0 && flushrunning)            // Stop the thread
+   {
+      flushgen++;
+      flushrunning = false;
+      join = true;
+   }
+   else if (msec > 0 && !flushrunning)       // Start one
+   {
+      flushgen++;
+      if (pthread_create(&flushthread, NULL, flusher_main,
+         (void*)(intptr_t)flushgen) != 0)
+      {
+         flushdelay = 0;
+         pthread_mutex_unlock(&flushlock);
+         printf("Could not start the flusher\n");
+         return -1;
+      }
+      flushrunning = true;
+      started = true;
+   }
+   pthread_cond_broadcast(&flushwake);       // Pick up the new delay
+   pthread_mutex_unlock(&flushlock);
+
+   if (join)
+   {
+      pthread_join(old, NULL);
+   }
+   if (started)                              // Time data already buffered
+   {
+      markdirtyall();
+   }
+   return 0;
+} // end setflushdelay
+
+// -------------------------------------------------------------- refill(FILE*)
+// Reads from the file and fills the buffer
+// Sets file's EOF field to true if amount read is less than full buffer
+// Used by read methods when buffer is empty or fully used
+// 
+// param: stream  Pointer to the file object whose buffer is being refilled
+// 
+// pre:    The file has been initialized an opened
+// post:   File buffer is refilled if data remains in the file
+//         EOF is set to true if amount read is less than buffer size
+//
+void refill(FILE* stream)
+{
+   if (stream == nullptr)                    // Parameter validation
+   {
+      printf("Null file parameter");
+      return;
+   }
+   if (stream->mode == _IONBF || stream->mapped) // No-buffer / mapped check
+   {
+      return;
+   }
+   if (stream->buffer == (char*)0 && bufalloc(stream) == -1) // First read
+   {
+      stream->actual_size = -1;
+      return;
+   }
+   if (stream->lz != NULL)                   // Decompress the next block
+   {
+      lz_refill(stream);
+      return;
+   }
+   if (stream->direct)                       // Aligned read around fpos
+   {
+      dio_refill(stream);
+      return;
+   }
+
+   if (stream->mode == _IORA && stream->ra == NULL)
+   {
+      ra_start(stream);                      // First read of a _IORA stream
+   }
+   STAT_ADD(stream, refills, 1);
+
+   if (stream->ra != NULL)                   // Swap in the read-ahead block
+   {
+      ra_refill(stream);
+   }
+   else
+   {
+      adapt_refill(stream);                  // Resize to the access pattern
+      stream->actual_size = io_read(stream, stream->buffer, stream->size);
+   }
+   stream->pos = 0;
+   if (stream->actual_size == -1)
+   {
+      printf("Error in reading file\n");     // read() returns -1 on error
+      return;
+   }
+   if (stream->actual_size < stream->size)
+   {
+      stream->eof = true;                    // Set EOF if needed
+   }
+   return;
+} // end refill
+
+// ------------------------------- fread_unlocked(void*, size_t, size_t, FILE*)
+// Outputs a given amount of memory from the file buffer to the user buffer
+// Whatever the buffer cannot supply is read with one readv( ) straight
+//   into the user buffer, which also refills the stream buffer with the
+//   data that follows it
+// The caller must hold the stream lock, see flockfile( )
+// 
+// param: ptr     Pointer to an index in the user buffer
+// param: size    Byte size of one unit in the user buffer
+// param: nmemb   Number of units to read
+// param: stream  Pointer to the file object being read from
+// 
+// pre:    The file has been initialized an opened
+// post:   Requested amount of memory is read from the file to the user
+//           buffer, up to the end of the file
+//         EOF is set to true if amount read is less than buffer size
+//
+size_t fread_unlocked(void* ptr, size_t size, size_t nmemb, FILE* stream)
+{
+   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
+      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))
+   {
+      printf("Read permissions not granted\n"); // Permissions check
+      return -1;
+   }
+   if (stream == nullptr)                       // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (size < 1 || nmemb < 1)                   // Parameter validation
+   {
+      printf("nmemb must be > 0\n");
+      return -1;
+   }
+   if (stream->lastop == 'w')                   // Flush written data
+   {
+      fflush_unlocked(stream);
+   }
+   if ((stream->pos == stream->actual_size &&
+      (stream->actual_size > 0 || stream->pos > 0))
+      || stream->lastop == 0)                   // Buffer empty or used up
+   {
+      refill(stream);
+      if (stream->actual_size == -1)
+      {
+         return -1;
+      }
+   }
+
+   size_t totalMem = size * nmemb;              // Total memory needed
+   size_t offset = 0;                           // Total memory read
+   char* buf = (char*)ptr;                      // Current user buffer position
+   char* sbuf = stream->buffer + stream->pos;   // Current file buffer position
+
+   // EOF reached in buffer
+   if (stream->eof)                             // EOF read into buffer
+   {
+      if (stream->pos != stream->actual_size)   // Buffer not finished
+      {
+         offset = stream->actual_size - stream->pos;
+         if (offset > totalMem)                 // Only what was asked for
+         {
+            offset = totalMem;
+         }
+         memcpy(buf, sbuf, offset);             // Finish reading buffer
+
+         stream->pos += offset;
+         stream->fpos += offset;
+         stream->lastop = 'r';
+         return offset;
+      }
+      else                                      // Buffer finished
+      {
+         stream->lastop = 'r';
+         fpurge_unlocked(stream);                // Just clear buffer & return 0
+         return 0;
+      }
+   }
+
+   // No buffer allowed
+   if (stream->size == 0 || stream->mode == _IONBF) // No buffer
+   {
+      stream->actual_size = io_read(stream, buf, totalMem); // Read from disk
+
+      if (stream->actual_size != -1)
+      {
+         if (stream->actual_size < stream->size)
+         {
+            stream->eof = true;
+         }
+         stream->fpos += stream->actual_size;
+         stream->lastop = 'r';
+         return stream->actual_size;
+      }
+   }
+
+   // Requested memory is less than remaining unread buffer contents
+   if (totalMem + stream->pos <= (size_t)stream->actual_size) // Unread mem
+   {
+      STAT_ADD(stream, hits, 1);
+      if (stream->actual_size != -1)
+      {
+         memcpy(buf, sbuf, totalMem);           // Read the mem into user buff
+         buf += totalMem;                       // Move user buffer pointer
+         sbuf += totalMem;                      // Move file buffer pointer
+         offset += totalMem;                    // Track amount of mem passed
+         stream->pos += totalMem;               // Track position in file buff
+         stream->fpos += totalMem;              // Track position in file
+      }
+   }
+   // Requested memory is more than remaining unread buffer contents
+   else                                         // Wants mem past end of buffer
+   {
+      STAT_ADD(stream, misses, 1);
+      offset = stream->actual_size - stream->pos;
+      memcpy(buf, sbuf, offset);                // Read remaining buffer
+      buf += offset;
+      stream->fpos += offset;
+      stream->pos = stream->actual_size;
+      if (stream->ra != NULL)                   // Direct reads use the fd
+      {
+         ra_sync(stream);
+      }
+
+      if (stream->lz != NULL || stream->direct) // One block at a time
+      {
+         while (offset < totalMem && !stream->eof)
+         {
+            refill(stream);
+            if (stream->pos >= stream->actual_size)
+            {
+               break;
+            }
+            size_t n = stream->actual_size - stream->pos;
+            n = (n < totalMem - offset) ? n : totalMem - offset;
+            memcpy(buf, stream->buffer + stream->pos, n);
+            buf += n;
+            offset += n;
+            stream->pos += n;
+            stream->fpos += n;
+         }
+      }
+      else if (!stream->eof)                    // Read the rest in one call
+      {
+         adapt_refill(stream);                  // Buffer is used up here
+         size_t want = totalMem - offset;       // Still owed to the user
+         struct iovec iov[2];                   // User memory, then readahead
+         iov[0].iov_base = buf;
+         iov[0].iov_len = want;
+         iov[1].iov_base = stream->buffer;
+         iov[1].iov_len = stream->size;
+
+         ssize_t got = io_readv(stream, iov, 2);
+         if (got == -1)
+         {
+            stream->actual_size = -1;
+         }
+         else
+         {
+            size_t mine = ((size_t)got < want) ? got : want;
+            offset += mine;
+            stream->fpos += mine;
+            stream->actual_size = got - mine;   // Tail landed in the buffer
+            stream->pos = 0;
+            if ((size_t)got < want + stream->size) // Short read, as refill( )
+            {
+               stream->eof = true;
+            }
+         }
+      }
+   }
+
+   stream->lastop = 'r';
+   if (stream->actual_size == -1)               // read() returns -1 on error
+      return -1;
+   else
+      return offset;
+} // end fread_unlocked
+
+// ---------------------------------------- fread(void*, size_t, size_t, FILE*)
+// Locks the stream around fread_unlocked( )
+//
+size_t fread(void* ptr, size_t size, size_t nmemb, FILE* stream)
+{
+   flockfile(stream);
+   size_t result = fread_unlocked(ptr, size, nmemb, stream);
+   funlockfile(stream);
+   return result;
+} // end fread
+
+// ---------------------------------- freadv_unlocked(FILE*, const iovec*, int)
+// Scatters the next bytes of the file across several user buffers
+// Buffered data is copied out first; the segments it does not cover are
+//   then filled by one readv( ), which also refills the stream buffer
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being read from
+// param: iov     User buffers, filled in order
+// param: iovcnt  Number of buffers, 1 to IOV_MAX
+//
+// pre:    The file has been initialized an opened
+// post:   The buffers hold the next bytes of the file, up to its end
+//         EOF is set to true if the read came up short
+// return: Number of bytes read, -1 on error
+//
+ssize_t freadv_unlocked(FILE* stream, const struct iovec* iov, int iovcnt)
+{
+   if (stream == nullptr || iov == nullptr)     // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return -1;
+   }
+   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
+      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))
+   {                                            // Permissions check
+      printf("Read permissions not granted\n");
+      return -1;
+   }
+   if (iovcnt < 1 || iovcnt > IOV_MAX)          // Parameter validation
+   {
+      printf("Invalid iovec count\n");
+      return -1;
+   }
+   if (stream->lastop == 'w')                   // Flush written data
+   {
+      fflush_unlocked(stream);
+   }
+   if (stream->lz != NULL || stream->direct)    // Blocks come one at a time
+   {
+      ssize_t done = 0;
+      for (int i = 0; i < iovcnt; i++)
+      {
+         if (iov[i].iov_len == 0)
+         {
+            continue;
+         }
+         size_t got = fread_unlocked(iov[i].iov_base, 1, iov[i].iov_len,
+            stream);
+         if (got == (size_t)-1)
+         {
+            return (done > 0) ? done : -1;
+         }
+         done += got;
+         if (got < iov[i].iov_len)              // End of file
+         {
+            break;
+         }
+      }
+      return done;
+   }
+
+   bool buffered = (stream->size > 0 && stream->mode != _IONBF);
+   size_t avail = (buffered && stream->actual_size > stream->pos)
+      ? stream->actual_size - stream->pos : 0;  // Unread bytes in the buffer
+   struct iovec* rest = new struct iovec[iovcnt + 1]; // Segments left to fill
+   int cnt = 0;
+   size_t want = 0;                             // Bytes left to fill
+   size_t done = 0;                             // Bytes handed to the user
+
+   for (int i = 0; i < iovcnt; i++)             // Drain the buffer first
+   {
+      char* base = (char*)iov[i].iov_base;
+      size_t n = (avail < iov[i].iov_len) ? avail : iov[i].iov_len;
+      if (n > 0)
+      {
+         memcpy(base, stream->buffer + stream->pos, n);
+         stream->pos += n;
+         avail -= n;
+         done += n;
+      }
+      if (iov[i].iov_len > n)
+      {
+         rest[cnt].iov_base = base + n;
+         rest[cnt++].iov_len = iov[i].iov_len - n;
+         want += iov[i].iov_len - n;
+      }
+   }
+   stream->fpos += done;
+   stream->lastop = 'r';
+   STAT_ADD(stream, hits, (want == 0) ? 1 : 0);
+   STAT_ADD(stream, misses, (want > 0) ? 1 : 0);
+
+   ssize_t got = 0;                             // Bytes from readv( )
+   if (want > 0 && !stream->eof)                // One call for the rest
+   {
+      if (stream->ra != NULL)                   // Direct reads use the fd
+      {
+         ra_sync(stream);
+      }
+      bool ahead = (buffered && cnt < IOV_MAX && // Refill the buffer too
+         bufalloc(stream) == 0);
+      if (ahead)
+      {
+         adapt_refill(stream);
+         rest[cnt].iov_base = stream->buffer;
+         rest[cnt++].iov_len = stream->size;
+      }
+
+      got = io_readv(stream, rest, cnt);
+      if (got == -1)
+      {
+         printf("Error in reading file\n");
+      }
+      else
+      {
+         size_t mine = ((size_t)got < want) ? got : want;
+         done += mine;
+         stream->fpos += mine;
+         if (ahead)
+         {
+            stream->actual_size = got - mine;   // Tail landed in the buffer
+            stream->pos = 0;
+         }
+         if ((size_t)got < want + (ahead ? stream->size : 0))
+         {
+            stream->eof = true;                 // Short read, as refill( )
+         }
+      }
+   }
+   delete[] rest;
+
+   return (got == -1 && done == 0) ? -1 : (ssize_t)done;
+} // end freadv_unlocked
+
+// ------------------------------------------- freadv(FILE*, const iovec*, int)
+// Locks the stream around freadv_unlocked( )
+//
+ssize_t freadv(FILE* stream, const struct iovec* iov, int iovcnt)
+{
+   flockfile(stream);
+   ssize_t result = freadv_unlocked(stream, iov, iovcnt);
+   funlockfile(stream);
+   return result;
+} // end freadv
+
+// ------------------------ fwrite_unlocked(const void*, size_t, size_t, FILE*)
+// Inputs data from the user buffer into the stream buffer
+// The buffer is only written to the file once it fills up, or on
+//   fflush() / fclose()
+// Requests at least as large as the buffer skip it and go straight
+//   to the file, gathered into one writev( ) with any pending data
+// Append streams never seek first, O_APPEND places every write
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: ptr     Pointer to an index in the user buffer
+// param: size    Byte size of one unit in the user buffer
+// param: nmemb   Number of units to write
+// param: stream  Pointer to the file object being written to
+//
+// pre:    The file has been initialized an opened
+// post:   Requested amount of memory is buffered or written to the file
+// return: Number of bytes accepted, -1 on error
+//
+size_t fwrite_unlocked(const void* ptr, size_t size, size_t nmemb, FILE* stream)
+{
+   if (stream == nullptr)                             // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (stream->flag == O_RDONLY)                      // Permissions check
+   {
+      printf("Write permissions not granted\n");
+      return -1;
+   }
+   if (stream->flag & O_APPEND)                       // O_APPEND places data
+   {
+      stream->astale = true;
+   }
+   if (size < 1 || nmemb < 1)                         // Parameter validation
+   {
+      printf("Invalid memory parameter");
+      return -1;
+   }
+
+   size_t totalMem = size * nmemb;                    // Total mem to write
+   ssize_t written = 0;                               // Mem sent to the file
+   const char* in = (const char*)ptr;                 // Pointer to user buffer
+
+   if (stream->size == 0 || stream->mode == _IONBF)   // No buffer
+   {
+      written = io_writeall(stream, in, totalMem);
+      if (written == -1)                              // write() error
+      {
+         return -1;
+      }
+      stream->fpos += written;
+
+      stream->lastop = 'w';
+      return written;
+   }
+
+   if (stream->lastop == 'r')                         // Purge after reads
+   {
+      fpurge_unlocked(stream);
+   }
+
+   if (stream->buffer == (char*)0 && bufalloc(stream) == -1) // First write
+   {
+      return -1;
+   }
+
+   size_t room = stream->size - stream->pos;          // Free space in buffer
+
+   if (totalMem < room)                               // Fits in the buffer
+   {
+      memcpy(stream->buffer + stream->pos, in, totalMem);
+      stream->pos += totalMem;
+      stream->fpos += totalMem;
+      stream->lastop = 'w';
+      markdirty(stream);
+      return (flushline(stream, totalMem) == -1) ? -1 : totalMem;
+   }
+
+   if (totalMem >= (size_t)stream->size && stream->lz == NULL &&
+      !stream->direct)                                // Larger than buffer
+   {
+      struct iovec iov[2];                            // Pending data, then ours
+      int cnt = 0;
+      size_t pending = (stream->lastop == 'w') ? stream->pos : 0;
+      if (pending > 0)
+      {
+         iov[cnt].iov_base = stream->buffer;
+         iov[cnt++].iov_len = pending;
+      }
+      iov[cnt].iov_base = (void*)in;
+      iov[cnt++].iov_len = totalMem;
+
+      STAT_ADD(stream, flushes, (pending > 0) ? 1 : 0);
+      written = io_writevall(stream, iov, cnt);       // One gathered write
+      stream->pos = 0;                                // Buffer is drained
+      stream->actual_size = 0;
+      __atomic_store_n(&stream->dirtysince, 0, __ATOMIC_RELAXED);
+      stream->lastop = 'w';
+      if (written == -1 || (size_t)written < pending)
+      {
+         printf("Error in writing file\n");
+         return -1;
+      }
+      written -= pending;
+      stream->fpos += written;
+      if (stream->astale)                             // Appends moved the end
+      {
+         stream->fsize = -1;
+      }
+      else if (stream->fsize != -1 && stream->fpos > stream->fsize)
+      {
+         stream->fsize = stream->fpos;
+      }
+      return written;
+   }
+
+   size_t done = 0;                                   // Mem taken so far
+   while (totalMem - done >= room)                    // Top off the buffer
+   {                                                  // (each is one block)
+      memcpy(stream->buffer + stream->pos, in + done, room);
+      stream->pos = stream->size;
+      stream->fpos += room;
+      stream->lastop = 'w';
+      if (fflush_unlocked(stream) == -1)              // Buffer is full
+      {
+         return -1;
+      }
+      done += room;
+      room = stream->size - stream->pos;
+   }
+
+   memcpy(stream->buffer + stream->pos, in + done, totalMem - done);
+   stream->pos += totalMem - done;                    // Buffer the remainder
+   stream->fpos += totalMem - done;
+   stream->lastop = 'w';
+   markdirty(stream);
+   return (flushline(stream, totalMem) == -1) ? -1 : totalMem;
+} // end fwrite_unlocked
+
+// --------------------------------- fwrite(const void*, size_t, size_t, FILE*)
+// Locks the stream around fwrite_unlocked( )
+//
+size_t fwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream)
+{
+   flockfile(stream);
+   size_t result = fwrite_unlocked(ptr, size, nmemb, stream);
+   funlockfile(stream);
+   return result;
+} // end fwrite
+
+// --------------------------------- fwritev_unlocked(FILE*, const iovec*, int)
+// Gathers several user buffers into the file, in order
+// Segments that fit in the buffer together are copied into it like a
+//   small fwrite( )
+// Otherwise nothing is copied: any pending buffered data and all of the
+//   segments go out in one writev( )
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being written to
+// param: iov     User buffers, written in order
+// param: iovcnt  Number of buffers, 1 to IOV_MAX
+//
+// pre:    The file has been initialized an opened
+// post:   The segments are buffered or written to the file
+// return: Number of bytes accepted, -1 on error
+//
+ssize_t fwritev_unlocked(FILE* stream, const struct iovec* iov, int iovcnt)
+{
+   if (stream == nullptr || iov == nullptr)           // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return -1;
+   }
+   if (stream->flag == O_RDONLY)                      // Permissions check
+   {
+      printf("Write permissions not granted\n");
+      return -1;
+   }
+   if (iovcnt < 1 || iovcnt > IOV_MAX)                // Parameter validation
+   {
+      printf("Invalid iovec count\n");
+      return -1;
+   }
+   if (stream->flag & O_APPEND)                       // O_APPEND places data
+   {
+      stream->astale = true;
+   }
+
+   size_t totalMem = 0;                               // Total mem to write
+   for (int i = 0; i < iovcnt; i++)
+   {
+      totalMem += iov[i].iov_len;
+   }
+   if (totalMem == 0)
+   {
+      return 0;
+   }
+   if (stream->lz != NULL || stream->direct)          // Copied into blocks
+   {
+      for (int i = 0; i < iovcnt; i++)
+      {
+         if (iov[i].iov_len > 0 && fwrite_unlocked(iov[i].iov_base, 1,
+            iov[i].iov_len, stream) != iov[i].iov_len)
+         {
+            return -1;
+         }
+      }
+      return totalMem;
+   }
+
+   bool buffered = (stream->size > 0 && stream->mode != _IONBF);
+   if (buffered && stream->lastop == 'r')             // Purge after reads
+   {
+      fpurge_unlocked(stream);
+   }
+
+   if (buffered && totalMem < (size_t)(stream->size - stream->pos))
+   {                                                  // Fits in the buffer
+      if (stream->buffer == (char*)0 && bufalloc(stream) == -1)
+      {
+         return -1;
+      }
+      for (int i = 0; i < iovcnt; i++)
+      {
+         memcpy(stream->buffer + stream->pos, iov[i].iov_base, iov[i].iov_len);
+         stream->pos += iov[i].iov_len;
+      }
+      stream->fpos += totalMem;
+      stream->lastop = 'w';
+      markdirty(stream);
+      return (flushline(stream, totalMem) == -1) ? -1 : (ssize_t)totalMem;
+   }
+
+   size_t pending = (buffered && stream->lastop == 'w') ? stream->pos : 0;
+   if (pending > 0 && iovcnt == IOV_MAX)              // No slot left for it
+   {
+      if (fflush_unlocked(stream) == -1)
+      {
+         return -1;
+      }
+      pending = 0;
+   }
+
+   struct iovec* all = new struct iovec[iovcnt + 1];  // Pending data, then ours
+   int cnt = 0;
+   if (pending > 0)
+   {
+      all[cnt].iov_base = stream->buffer;
+      all[cnt++].iov_len = pending;
+   }
+   memcpy(all + cnt, iov, iovcnt * sizeof(struct iovec));
+   cnt += iovcnt;
+
+   STAT_ADD(stream, flushes, (pending > 0) ? 1 : 0);
+   ssize_t written = io_writevall(stream, all, cnt);  // One gathered write
+   delete[] all;
+   if (buffered)                                      // Buffer is drained
+   {
+      stream->pos = 0;
+      stream->actual_size = 0;
+      __atomic_store_n(&stream->dirtysince, 0, __ATOMIC_RELAXED);
+   }
+   stream->lastop = 'w';
+   if (written == -1 || (size_t)written < pending)
+   {
+      printf("Error in writing file\n");
+      return -1;
+   }
+   written -= pending;
+   stream->fpos += written;
+   if (stream->astale)                                // Appends moved the end
+   {
+      stream->fsize = -1;
+   }
+   else if (stream->fsize != -1 && stream->fpos > stream->fsize)
+   {
+      stream->fsize = stream->fpos;
+   }
+   return written;
+} // end fwritev_unlocked
+
+// ------------------------------------------ fwritev(FILE*, const iovec*, int)
+// Locks the stream around fwritev_unlocked( )
+//
+ssize_t fwritev(FILE* stream, const struct iovec* iov, int iovcnt)
+{
+   flockfile(stream);
+   ssize_t result = fwritev_unlocked(stream, iov, iovcnt);
+   funlockfile(stream);
+   return result;
+} // end fwritev
+
+// ------------------------------------------- pflushover(FILE*, off_t, size_t)
+// Flushes buffered writes that overlap a positional access, so pread( )
+//   sees them and a later flush cannot overwrite a pwrite( )
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being accessed
+// param: off     File offset of the access
+// param: n       Length of the access
+//
+// return: 0 on success, -1 if the flush failed
+//
+int pflushover(FILE* stream, off_t off, size_t n)
+{
+   if (stream->lastop != 'w' || stream->pos == 0)  // Nothing dirty
+   {
+      return 0;
+   }
+
+   off_t dirty = stream->fpos - stream->pos;       // File offset of buffer[0]
+   if (!stream->astale &&                          // Where it lands is known
+      (off >= stream->fpos || off + (off_t)n <= dirty))
+   {
+      return 0;
+   }
+   return fflush_unlocked(stream);
+} // end pflushover
+
+// -------------------------------- fpread(void*, size_t, size_t, FILE*, off_t)
+// Reads from a given file offset without moving the stream's position
+// The stream lock is only held to flush buffered writes that overlap the
+//   range; the pread( )s themselves run unlocked, so any number of
+//   threads may read one stream at once
+// Memory-mapped streams copy straight out of the mapping
+//
+// param: ptr     Pointer to an index in the user buffer
+// param: size    Byte size of one unit in the user buffer
+// param: nmemb   Number of units to read
+// param: stream  Pointer to the file object being read from
+// param: off     File offset to read from
+//
+// pre:    The file has been initialized an opened
+// post:   The user buffer holds the file's bytes from off, up to its end
+//         pos, fpos, the buffer and EOF are unchanged
+// return: Number of bytes read, -1 on error
+//
+size_t fpread(void* ptr, size_t size, size_t nmemb, FILE* stream, off_t off)
+{
+   if (stream == nullptr || ptr == nullptr)     // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return -1;
+   }
+   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
+      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))
+   {                                            // Permissions check
+      printf("Read permissions not granted\n");
+      return -1;
+   }
+   if (stream->lz != NULL || stream->direct)    // File offsets are not ours
+   {                                            // or need alignment
+      printf("Positional reads not allowed on this stream\n");
+      return -1;
+   }
+   if (size < 1 || nmemb < 1 || off < 0)        // Parameter validation
+   {
+      printf("Invalid memory parameter");
+      return -1;
+   }
+
+   size_t totalMem = size * nmemb;              // Total memory needed
+   char* buf = (char*)ptr;
+
+   if (stream->mapped)                          // The file is in memory
+   {
+      if (off >= stream->actual_size)
+      {
+         return 0;
+      }
+      if (totalMem > (size_t)(stream->actual_size - off))
+      {
+         totalMem = stream->actual_size - off;
+      }
+      memcpy(buf, stream->buffer + off, totalMem);
+      return totalMem;
+   }
+
+   flockfile(stream);
+   int flushed = pflushover(stream, off, totalMem);
+   funlockfile(stream);
+   if (flushed == -1)
+   {
+      return -1;
+   }
+
+   size_t offset = 0;                           // Total memory read
+   while (offset < totalMem)                    // Retry short reads
+   {
+      ssize_t got = io_pread(stream, buf + offset, totalMem - offset,
+         off + offset);
+      if (got == -1)
+      {
+         printf("Error in reading file\n");
+         return (offset > 0) ? offset : (size_t)-1;
+      }
+      if (got == 0)                             // End of file
+      {
+         break;
+      }
+      offset += got;
+   }
+   return offset;
+} // end fpread
+
+// ------------------------- fpwrite(const void*, size_t, size_t, FILE*, off_t)
+// Writes at a given file offset without moving the stream's position
+// Overlapping buffered writes are flushed first, and bytes the stream
+//   has already read into its buffer are patched afterwards, so its own
+//   reads and writes stay coherent with the pwrite( )
+// The pwrite( )s run without the stream lock, so any number of threads
+//   may write disjoint ranges of one stream at once
+// Append streams are refused, since O_APPEND makes pwrite( ) ignore off
+//
+// param: ptr     Pointer to an index in the user buffer
+// param: size    Byte size of one unit in the user buffer
+// param: nmemb   Number of units to write
+// param: stream  Pointer to the file object being written to
+// param: off     File offset to write at
+//
+// pre:    The file has been initialized an opened
+// post:   The file holds the user's bytes at off
+//         pos and fpos are unchanged
+// return: Number of bytes written, -1 on error
+//
+size_t fpwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream,
+   off_t off)
+{
+   if (stream == nullptr || ptr == nullptr)           // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return -1;
+   }
+   if (stream->flag == O_RDONLY)                      // Permissions check
+   {
+      printf("Write permissions not granted\n");
+      return -1;
+   }
+   if (stream->flag & O_APPEND)                       // pwrite( ) would append
+   {
+      printf("Positional writes not allowed in append mode\n");
+      return -1;
+   }
+   if (stream->lz != NULL || stream->direct)          // Blocks are appended
+   {                                                  // or need alignment
+      printf("Positional writes not allowed on this stream\n");
+      return -1;
+   }
+   if (size < 1 || nmemb < 1 || off < 0)              // Parameter validation
+   {
+      printf("Invalid memory parameter");
+      return -1;
+   }
+
+   size_t totalMem = size * nmemb;                    // Total mem to write
+   const char* in = (const char*)ptr;
+
+   flockfile(stream);
+   int flushed = pflushover(stream, off, totalMem);
+   funlockfile(stream);
+   if (flushed == -1)
+   {
+      return -1;
+   }
+
+   size_t written = 0;                                // Mem sent to the file
+   while (written < totalMem)                         // Retry short writes
+   {
+      ssize_t put = io_pwrite(stream, in + written, totalMem - written,
+         off + written);
+      if (put <= 0)                                   // pwrite() error
+      {
+         break;
+      }
+      written += put;
+   }
+   if (written == 0)
+   {
+      printf("Error in writing file\n");
+      return -1;
+   }
+
+   flockfile(stream);
+   if (stream->ds != NULL)                            // Count toward fcommit( )
+   {
+      dsync_note(stream, written);
+   }
+   if (stream->ra != NULL)                            // Prefetch may be stale
+   {
+      ra_sync(stream);
+   }
+   if (stream->lastop == 'r' && stream->actual_size > 0)
+   {                                                  // Patch the read buffer
+      off_t bufstart = stream->fpos - stream->pos;
+      off_t from = (off > bufstart) ? off : bufstart;
+      off_t to = off + written;
+      if (to > bufstart + stream->actual_size)
+      {
+         to = bufstart + stream->actual_size;
+      }
+      if (from < to)
+      {
+         memcpy(stream->buffer + (from - bufstart), in + (from - off),
+            to - from);
+      }
+   }
+   if (stream->fsize != -1 && off + (off_t)written > stream->fsize)
+   {
+      stream->fsize = off + written;                  // Grew the file
+   }
+   funlockfile(stream);
+   return written;
+} // end fpwrite
+
+// ------------------------------------------------- fcopy_method(FILE*, FILE*)
+// Picks how fcopy( ) moves data between two streams
+// Only plain descriptors whose offsets follow fpos can be handed to the
+//   kernel: not mapped, compressed or direct streams, nor appends
+//
+// return: COPY_RANGE, or COPY_BUFFER if the kernel cannot be used
+//
+int fcopy_method(FILE* dst, FILE* src)
+{
+   if (src->mapped || src->lz != NULL || src->direct ||
+      dst->lz != NULL || dst->direct || (dst->flag & O_APPEND))
+   {
+      return COPY_BUFFER;
+   }
+   return COPY_RANGE;
+} // end fcopy_method
+
+// --------------------------------------- fcopy_unlocked(FILE*, FILE*, size_t)
+// Copies up to n bytes from src's position to dst's
+// Whatever src has already buffered is written to dst first; the rest
+//   moves between the descriptors inside the kernel, with
+//   copy_file_range( ), then sendfile( ), then splice( ), as each turns
+//   out to be unsupported for the pair
+// Streams the kernel cannot serve, and anything it left, are copied
+//   through a pooled bounce buffer with fread( ) and fwrite( )
+// The caller must hold both stream locks, see fcopy( )
+//
+// param: dst     Pointer to the file object being written to
+// param: src     Pointer to the file object being read from
+// param: n       Most bytes to copy
+//
+// pre:    src is open for reading and dst for writing
+// post:   Both fpos are advanced by the bytes copied
+// return: Number of bytes copied, less than n at end of file, -1 on error
+//
+size_t fcopy_unlocked(FILE* dst, FILE* src, size_t n)
+{
+   size_t done = 0;                          // Bytes copied so far
+
+   if (src->lastop == 'w' && src->mode != _IONBF &&
+      fflush_unlocked(src) == -1)            // Unbuffered has none pending
+   {
+      return -1;
+   }
+   if ((src->mapped || src->lastop == 'r') && src->actual_size > src->pos)
+   {                                         // Drain what src holds
+      size_t avail = src->actual_size - src->pos;
+      avail = (avail < n) ? avail : n;
+      if (fwrite_unlocked(src->buffer + src->pos, 1, avail, dst) != avail)
+      {
+         return -1;
+      }
+      src->pos += avail;
+      src->fpos += avail;
+      src->lastop = 'r';
+      done = avail;
+   }
+
+   int how = fcopy_method(dst, src);
+   if (done < n && how != COPY_BUFFER)       // Bulk of it in the kernel
+   {
+      if (dst->lastop == 'w' && dst->mode != _IONBF &&
+         fflush_unlocked(dst) == -1)
+      {
+         return -1;
+      }
+      if (dst->lastop == 'r')                // Offsets must follow fpos
+      {
+         fpurge_unlocked(dst);
+      }
+      fpurge_unlocked(src);
+
+      int pipefd[2] = { -1, -1 };
+      while (done < n && how != COPY_BUFFER)
+      {
+         if (how == COPY_SPLICE && pipefd[0] == -1 && pipe(pipefd) == -1)
+         {
+            how = COPY_BUFFER;
+            break;
+         }
+         size_t chunk = (n - done < (1 << 30)) ? n - done : (1 << 30);
+         ssize_t moved = io_copy(dst, src, chunk, how, pipefd);
+         if (moved > 0)
+         {
+            done += moved;
+            src->fpos += moved;
+            dst->fpos += moved;
+         }
+         else if (moved == 0)                // End of src
+         {
+            src->eof = true;
+            break;
+         }
+         else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+            errno == EOPNOTSUPP)             // Not for this pair, next one
+         {
+            how++;
+         }
+         else
+         {
+            printf("Error in copying file\n");
+            done = (done > 0) ? done : (size_t)-1;
+            break;
+         }
+      }
+      if (pipefd[0] != -1)
+      {
+         close(pipefd[0]);
+         close(pipefd[1]);
+      }
+      if (dst->fsize != -1 && dst->fpos > dst->fsize)
+      {
+         dst->fsize = dst->fpos;
+      }
+      if (done == (size_t)-1 || how != COPY_BUFFER)
+      {
+         return done;
+      }
+   }
+
+   if (done < n && !src->eof)                // Through a bounce buffer
+   {
+      size_t size = POOL_MAXSIZE;
+      char* bounce = bufpool_get(&size);
+      if (bounce == NULL)
+      {
+         return (done > 0) ? done : (size_t)-1;
+      }
+      while (done < n)
+      {
+         size_t want = (n - done < size) ? n - done : size;
+         size_t got = fread_unlocked(bounce, 1, want, src);
+         if (got == (size_t)-1 || got == 0)
+         {
+            break;
+         }
+         if (fwrite_unlocked(bounce, 1, got, dst) != got)
+         {
+            done = (done > 0) ? done : (size_t)-1;
+            break;
+         }
+         done += got;
+         if (got < want)                     // End of src
+         {
+            break;
+         }
+      }
+      bufpool_put(bounce, size);
+   }
+   return done;
+} // end fcopy_unlocked
+
+// ------------------------------------------------ fcopy(FILE*, FILE*, size_t)
+// Locks both streams, in address order so two opposite copies cannot
+//   deadlock, around fcopy_unlocked( )
+//
+size_t fcopy(FILE* dst, FILE* src, size_t n)
+{
+   if (dst == nullptr || src == nullptr)     // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (src->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
+      src->flag == (O_WRONLY | O_CREAT | O_APPEND) || dst->flag == O_RDONLY)
+   {                                         // Permissions check
+      printf("Copy permissions not granted\n");
+      return -1;
+   }
+   if (dst == src)
+   {
+      printf("Cannot copy a stream onto itself\n");
+      return -1;
+   }
+   if (n == 0)
+   {
+      return 0;
+   }
+
+   FILE* first = (dst < src) ? dst : src;
+   FILE* second = (dst < src) ? src : dst;
+   flockfile(first);
+   flockfile(second);
+   size_t result = fcopy_unlocked(dst, src, n);
+   funlockfile(second);
+   funlockfile(first);
+   return result;
+} // end fcopy
+
+// Line buffer of a stream, made by the first line or record that does
+//   not fit in the stream buffer
+struct linestate
+{
+   char* buf;                       // Line collected across refills
+   size_t size;                     // Size of buf
+};
+
+// ---------------------------------------------------- growline(FILE*, size_t)
+// Makes sure the stream's line buffer can hold at least need bytes
+// Used by fgetln() for lines that do not fit in the stream buffer
+//
+// param: stream  Pointer to the file object owning the line buffer
+// param: need    Minimum number of bytes required
+//
+// post:   ln->buf holds at least need bytes, earlier contents are kept
+// return: 0 on success, -1 on error
+//
+int growline(FILE* stream, size_t need)
+{
+   if (stream->ln == NULL)
+   {
+      stream->ln = new linestate();
+   }
+   linestate* ln = stream->ln;
+   if (need <= ln->size)
+   {
+      return 0;
+   }
+
+   size_t newsize = (ln->size > 0) ? ln->size : 128;
+   while (newsize < need)
+   {
+      newsize *= 2;
+   }
+
+   char* grown = new char[newsize];
+   if (ln->buf != (char*)0)
+   {
+      memcpy(grown, ln->buf, ln->size);
+      delete[] ln->buf;
+   }
+   ln->buf = grown;
+   ln->size = newsize;
+   return 0;
+} // end growline
+
+// ------------------------------------------------------- getc_unlocked(FILE*)
+// Read a single character from the file/buffer and return it
+// The caller must hold the stream lock, see flockfile( )
+// 
+// param: stream  Pointer to the file object being read from
+// 
+// pre:    The file has been initialized an opened
+// post:   One char will have been read from the file or buffer
+// return: char value that was read
+//
+int getc_unlocked(FILE* stream)
+{
+   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
+      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))// Permissions check
+   {
+      printf("Read permissions not granted\n");
+      return -1;
+   }
+   if (stream == nullptr)                             // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (stream->size == 0 || stream->mode == _IONBF)   // No buffer
+   {
+      char c;
+      stream->actual_size = io_read(stream, &c, 1);   // Read from disk
+      stream->lastop = 'r';
+
+      if (stream->actual_size != -1)
+      {
          if (stream->actual_size == 0)
          {
-            stream->eof = true;
+            stream->eof = true;
+         }
+         stream->fpos += stream->actual_size;         // Advance file position
+         return (int)c;
+      }
+
+      else
+      {
+         return -1;
+      }
+   }
+   if (stream->lastop == 'w')                         // Flush written data
+   {
+      fflush_unlocked(stream);
+   }
+   if (stream->eof && stream->pos == stream->actual_size)// Out of data
+   {
+      fpurge_unlocked(stream);
+      return -1;
+   }
+   if (stream->pos == stream->actual_size ||
+      stream->lastop == 0)                            // Buffer empty/used up
+   {
+      STAT_ADD(stream, misses, 1);
+      refill(stream);
+      if (stream->pos >= stream->actual_size)         // Nothing was read
+      {
+         return -1;
+      }
+   }
+   else
+   {
+      STAT_ADD(stream, hits, 1);
+   }
+
+   char c;                                            // char to return
+   char* sbuf = stream->buffer + stream->pos;         // Current buff position
+
+   memcpy(&c, sbuf, 1);                               // Get char
+   stream->pos++;                                     // Advance buff pos
+   stream->fpos++;                                    // Advance file pos
+   stream->lastop = 'r';
+
+   if (stream->eof && stream->pos == stream->actual_size)
+   {
+      fpurge_unlocked(stream);                        // Clear used up buffer
+   }
+
+   return (int)c;
+} // end getc_unlocked
+
+// --------------------------------------------------------------- fgetc(FILE*)
+// Locks the stream around getc_unlocked( )
+//
+int fgetc(FILE* stream)
+{
+   flockfile(stream);
+   int result = getc_unlocked(stream);
+   funlockfile(stream);
+   return result;
+} // end fgetc
+
+// -------------------------------------------------- putc_unlocked(int, FILE*)
+// Writes a single char into the file
+// The caller must hold the stream lock, see flockfile( )
+// 
+// param: stream  Pointer to the file object being written to
+// param: inputChar  char to write to the file
+// 
+// pre:    The file has been initialized an opened
+// post:   inputChar will exist in the file data
+// return: char that was input (inputChar parameter)
+//
+int putc_unlocked(int inputChar, FILE* stream)
+{
+   if (stream == nullptr)                       // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+   if (stream->flag == O_RDONLY)                // Permissions check
+   {
+      printf("Write permissions not granted\n");
+      return -1;
+   }
+   if (stream->flag & O_APPEND)                 // O_APPEND places data
+   {
+      stream->astale = true;
+   }
+   if (inputChar < 0)                           // Parameter validation
+   {
+      printf("Invalid char parameter");
+      return -1;
+   }
+   if (stream->mode == _IONBF)                  // No-buffer check
+   {
+      char c = inputChar;
+      if (io_writeall(stream, &c, 1) == 1)
+      {
+         stream->fpos++;
+      }
+      stream->lastop = 'w';
+      return inputChar;
+   }
+   if (stream->lastop == 'r')                   // Purge if last op was read
+   {
+      fpurge_unlocked(stream);
+   }
+   if (stream->buffer == (char*)0 && bufalloc(stream) == -1)
+   {                                            // First write allocates
+      return -1;
+   }
+   if (stream->pos == stream->size)             // Flush if buffer is filled
+   {
+      fflush_unlocked(stream);
+   }
+
+   char* sbuf = stream->buffer + stream->pos;   // Point to current position in buffer
+   memcpy(sbuf, &inputChar, 1);
+   stream->pos++;
+   stream->fpos++;
+
+   stream->lastop = 'w';
+   markdirty(stream);
+   if (stream->pos == stream->size ||
+      (stream->mode == _IOLBF && inputChar == '\n'))
+   {
+      fflush_unlocked(stream);                   // Flush if buffer is filled
+   }                                             // or a line is finished
+
+   return inputChar;
+} // end putc_unlocked
+
+// ---------------------------------------------------------- fputc(int, FILE*)
+// Locks the stream around putc_unlocked( )
+//
+int fputc(int inputChar, FILE* stream)
+{
+   flockfile(stream);
+   int result = putc_unlocked(inputChar, stream);
+   funlockfile(stream);
+   return result;
+} // end fputc
+
+// ----------------------------------------- scanchr(const char*, size_t, char)
+// Finds the first occurrence of a byte in a block of memory
+// Compares 32 bytes per step with AVX2 or 16 with SSE2 when the compiler
+//   targets those instruction sets, then finishes one byte at a time
+//
+// param: p       Start of the memory being searched
+// param: n       Number of bytes to search
+// param: c       Byte being searched for
+//
+// return: Pointer to the first match, NULL if c does not occur
+//
+const char* scanchr(const char* p, size_t n, char c)
+{
+   const char* end = p + n;                  // One past the last byte
+
+#if defined(__AVX2__)
+   __m256i pat32 = _mm256_set1_epi8(c);
+   while (end - p >= 32)                     // 32 bytes per compare
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i*)p);
+      unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat32));
+      if (m != 0)
+      {
+         return p + __builtin_ctz(m);
+      }
+      p += 32;
+   }
+#endif
+#if defined(__SSE2__)
+   __m128i pat16 = _mm_set1_epi8(c);
+   while (end - p >= 16)                     // 16 bytes per compare
+   {
+      __m128i v = _mm_loadu_si128((const __m128i*)p);
+      unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pat16));
+      if (m != 0)
+      {
+         return p + __builtin_ctz(m);
+      }
+      p += 16;
+   }
+#endif
+
+   while (p < end)                           // Scalar tail / fallback
+   {
+      if (*p == c)
+      {
+         return p;
+      }
+      p++;
+   }
+   return NULL;
+} // end scanchr
+
+// ---------------------------------------- scanrchr(const char*, size_t, char)
+// Finds the last occurrence of a byte in a block of memory
+// Works backwards from the end with the same vector compares as scanchr( )
+//
+// param: p       Start of the memory being searched
+// param: n       Number of bytes to search
+// param: c       Byte being searched for
+//
+// return: Pointer to the last match, NULL if c does not occur
+//
+const char* scanrchr(const char* p, size_t n, char c)
+{
+   const char* end = p + n;                  // One past the next byte
+
+#if defined(__AVX2__)
+   __m256i pat32 = _mm256_set1_epi8(c);
+   while (end - p >= 32)                     // 32 bytes per compare
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(end - 32));
+      unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat32));
+      if (m != 0)
+      {
+         return end - 1 - __builtin_clz(m);
+      }
+      end -= 32;
+   }
+#endif
+#if defined(__SSE2__)
+   __m128i pat16 = _mm_set1_epi8(c);
+   while (end - p >= 16)                     // 16 bytes per compare
+   {
+      __m128i v = _mm_loadu_si128((const __m128i*)(end - 16));
+      unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pat16));
+      if (m != 0)
+      {
+         return end - 16 + 31 - __builtin_clz(m);
+      }
+      end -= 16;
+   }
+#endif
+
+   while (end > p)                           // Scalar head / fallback
+   {
+      end--;
+      if (*end == c)
+      {
+         return end;
+      }
+   }
+   return NULL;
+} // end scanrchr
+
+// ------------------------------------------ fgets_unlocked(char*, int, FILE*)
+// Read a string from the file/buffer
+// Up to parameter-dictated size of bytes
+// Returns a series of bytes ending in '\0'
+// The newline is located inside the stream buffer with scanchr() and the
+//   whole line is copied out at once, refilling only when a line runs
+//   past the end of the buffer
+// A final line without a newline has one appended when there is room
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: str     User's string buffer
+// param: size    Max size of user buffer
+// param: stream  Pointer to the file object being read from
+//
+// pre:    File has been opened and initialized
+// post:   The next string of bytes in the file is read
+// return: The string of bytes read from the file, NULL at EOF or on error
+//
+char* fgets_unlocked(char* str, int size, FILE* stream)
+{
+   if (stream == nullptr)           // Parameter validation
+   {
+      printf("Null file parameter");
+      return NULL;
+   }
+   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
+      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))
+   {                                // Permissions check
+      printf("Read permissions not granted\n");
+      return NULL;
+   }
+   if (size < 1)                    // Parameter validation
+   {
+      printf("Invalid size parameter");
+      return NULL;
+   }
+   if (stream->eof && stream->pos == stream->actual_size)
+   {                                // Out of data
+      return NULL;
+   }
+   if (stream->lastop == 'w')       // Flush written data
+   {
+      fflush_unlocked(stream);
+   }
+
+   int max = size - 1;              // Room left for the terminator
+   int i = 0;                       // Size (bytes) read
+   bool newline = false;            // Whether the line's '\n' was read
+
+   if (stream->size == 0 || stream->mode == _IONBF)
+   {                                // No buffer, read a char at a time
+      int c;
+      while (i < max && (c = getc_unlocked(stream)) != EOF)
+      {
+         str[i++] = c;
+         if (c == '\n')
+         {
+            newline = true;
+            break;
+         }
+      }
+   }
+   else
+   {
+      while (i < max)
+      {
+         if (stream->pos == stream->actual_size)
+         {                          // Buffer empty/used up
+            if (stream->eof)
+            {
+               break;
+            }
+            refill(stream);
+            if (stream->pos >= stream->actual_size)
+            {
+               stream->actual_size = stream->pos;
+               stream->eof = true;
+               break;
+            }
+         }
+
+         char* sbuf = stream->buffer + stream->pos; // Current buff position
+         size_t avail = stream->actual_size - stream->pos;
+         if (avail > (size_t)(max - i))
+         {
+            avail = max - i;        // Limit to the user buffer
+         }
+
+         const char* nl = scanchr(sbuf, avail, '\n');
+         size_t n = (nl != NULL) ? nl - sbuf + 1 : avail;
+
+         memcpy(str + i, sbuf, n);  // Copy the line (or its piece) at once
+         stream->pos += n;
+         stream->fpos += n;
+         stream->lastop = 'r';
+         i += n;
+
+         if (nl != NULL)
+         {
+            newline = true;
+            break;
+         }
+      }
+   }
+   stream->lastop = 'r';
+
+   if (i == 0)                      // Nothing left to read
+   {
+      return NULL;
+   }
+   if (!newline && i < max && stream->eof)
+   {                                // Append \n to the final line if needed
+      str[i++] = '\n';              // Otherwise write() overwrites its outputs
+   }
+   str[i] = '\0';
+
+   return str;
+} // end fgets_unlocked
+
+// --------------------------------------------------- fgets(char*, int, FILE*)
+// Locks the stream around fgets_unlocked( )
+//
+char* fgets(char* str, int size, FILE* stream)
+{
+   flockfile(stream);
+   char* result = fgets_unlocked(str, size, stream);
+   funlockfile(stream);
+   return result;
+} // end fgets
+
+// -------------------------------------------- fgetln_unlocked(FILE*, size_t*)
+// Returns a view of the next line without copying it to a user buffer
+// Lines found whole inside the stream buffer are returned in place
+// A line that runs past the end of the buffer is collected in the
+//   stream's line buffer, which grows as needed
+// The view includes the '\n' when present and is not '\0' terminated
+// It stays valid until the next operation on the stream
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being read from
+// param: len     Set to the length of the returned line
+//
+// pre:    File has been opened and initialized
+// post:   The stream is positioned after the returned line
+// return: Pointer to the start of the line, NULL at EOF or on error
+//
+char* fgetln_unlocked(FILE* stream, size_t* len)
+{
+   if (stream == nullptr || len == nullptr)  // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return NULL;
+   }
+   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
+      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))
+   {                                         // Permissions check
+      printf("Read permissions not granted\n");
+      return NULL;
+   }
+   if (stream->lastop == 'w')                // Flush written data
+   {
+      fflush_unlocked(stream);
+   }
+
+   *len = 0;
+
+   if (stream->size == 0 || stream->mode == _IONBF)
+   {                                         // No buffer, build in ln
+      int c;
+      while ((c = getc_unlocked(stream)) != EOF)
+      {
+         if (growline(stream, *len + 1) == -1)
+         {
+            return NULL;
+         }
+         stream->ln->buf[(*len)++] = c;
+         if (c == '\n')
+         {
+            break;
+         }
+      }
+      return (*len > 0) ? stream->ln->buf : NULL;
+   }
+
+   bool collecting = false;                  // Line is being built in ln
+
+   while (true)
+   {
+      if (stream->pos == stream->actual_size)
+      {                                      // Buffer empty/used up
+         if (stream->eof)
+         {
+            break;
+         }
+         refill(stream);
+         if (stream->pos >= stream->actual_size)
+         {
+            stream->actual_size = stream->pos;
+            stream->eof = true;
+            break;
+         }
+      }
+
+      char* sbuf = stream->buffer + stream->pos;
+      size_t avail = stream->actual_size - stream->pos;
+      const char* nl = scanchr(sbuf, avail, '\n');
+      size_t n = (nl != NULL) ? nl - sbuf + 1 : avail;
+
+      stream->pos += n;
+      stream->fpos += n;
+      stream->lastop = 'r';
+
+      if (!collecting && (nl != NULL ||
+         (stream->eof && stream->pos == stream->actual_size)))
+      {                                      // Whole line is in the buffer
+         *len = n;
+         return sbuf;
+      }
+
+      if (growline(stream, *len + n) == -1)  // Line crosses a refill
+      {
+         return NULL;
+      }
+      memcpy(stream->ln->buf + *len, sbuf, n);
+      *len += n;
+      collecting = true;
+
+      if (nl != NULL)
+      {
+         break;
+      }
+   }
+   stream->lastop = 'r';
+
+   return (*len > 0) ? stream->ln->buf : NULL;
+} // end fgetln_unlocked
+
+// ----------------------------------------------------- fgetln(FILE*, size_t*)
+// Locks the stream around fgetln_unlocked( )
+//
+char* fgetln(FILE* stream, size_t* len)
+{
+   flockfile(stream);
+   char* result = fgetln_unlocked(stream, len);
+   funlockfile(stream);
+   return result;
+} // end fgetln
+
+// Formatted input parses straight out of the stream buffer
+// A number or token that runs off the end of the buffer is carried into
+//   a small stack buffer across the refill( ), so it is still seen whole
+// Like the standard library's, only the bytes a conversion could not use
+//   inside one buffer are kept for the next call; bytes carried across a
+//   refill( ) and then rejected are lost, as with a one-byte ungetc( )
+// Unbuffered streams cannot look ahead, so they are refused
+#define SC_SPACE 1                  // ' ' \t \n \v \f \r
+#define SC_DIGIT 2                  // 0-9
+#define SC_HEX 4                    // 0-9 a-f A-F
+#define SC_SIGN 8                   // + -
+#define SC_XMARK 16                 // x X, as in 0x
+#define SC_FLOAT 32                 // Anything strtod( ) may accept
+#define SCAN_TMPSIZE 128            // Longest number carried over a refill
+
+// Character classes for the scanners, indexed by unsigned byte
+struct scantable
+{
+   unsigned char cls[256];
+
+   scantable()
+   {
+      memset(cls, 0, sizeof(cls));
+      for (const char* s = " \t\n\v\f\r"; *s != '\0'; s++)
+      {
+         cls[(unsigned char)*s] |= SC_SPACE;
+      }
+      for (int c = '0'; c <= '9'; c++)
+      {
+         cls[c] |= SC_DIGIT | SC_HEX | SC_FLOAT;
+      }
+      for (int c = 'a'; c <= 'f'; c++)
+      {
+         cls[c] |= SC_HEX;
+         cls[c - 'a' + 'A'] |= SC_HEX;
+      }
+      for (const char* s = "+-.eEiInNfFaAtTyY"; *s != '\0'; s++)
+      {
+         cls[(unsigned char)*s] |= SC_FLOAT;       // Digits, inf and nan
+      }
+      cls['+'] |= SC_SIGN;
+      cls['-'] |= SC_SIGN;
+      cls['x'] |= SC_XMARK;
+      cls['X'] |= SC_XMARK;
+   }
+};
+
+static const scantable scanclass;
+
+// Powers of ten a double holds exactly, for the fast path of scandouble( )
+static const double exact10s[23] =
+{
+   1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+   1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// -------------------------------------------- digits8(const char*, uint32_t*)
+// Converts eight ASCII digits at once inside one 64-bit register
+// The digit test and the three multiplies replace eight multiply-adds
+//
+// param: p       Eight readable bytes
+// param: v       Set to their value when all eight are digits
+//
+// return: true if all eight bytes are digits
+//
+inline bool digits8(const char* p, uint32_t* v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   uint64_t chunk;
+   memcpy(&chunk, p, 8);
+   if (((chunk & 0xF0F0F0F0F0F0F0F0ULL) |
+      (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) !=
+      0x3333333333333333ULL)               // Some byte is not '0'-'9'
+   {
+      return false;
+   }
+   chunk -= 0x3030303030303030ULL;
+   chunk = (chunk * 10) + (chunk >> 8);     // Pairs of digits
+   chunk = (((chunk & 0x000000FF000000FFULL) * 0x000F424000000064ULL) +
+      (((chunk >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL)) >> 32;
+   *v = (uint32_t)chunk;
+   return true;
+#else
+   return false;                            // Scalar loop handles it
+#endif
+} // end digits8
+
+// ----------------------------- scandec(const char*, size_t, uint64_t*, bool*)
+// Appends the decimal digits at the start of p to *v
+// Runs of eight digits are converted together by digits8( )
+//
+// param: p       Text being parsed
+// param: len     Bytes of text available
+// param: v       Value so far in, value with the digits appended out
+// param: over    Set if the value no longer fits in 64 bits
+//
+// return: Number of digits used
+//
+size_t scandec(const char* p, size_t len, uint64_t* v, bool* over)
+{
+   size_t i = 0;
+   uint64_t val = *v;
+   uint32_t eight;
+
+   while (i + 8 <= len && digits8(p + i, &eight))
+   {
+      if (__builtin_mul_overflow(val, 100000000ULL, &val) ||
+         __builtin_add_overflow(val, (uint64_t)eight, &val))
+      {
+         *over = true;
+      }
+      i += 8;
+   }
+   while (i < len && p[i] >= '0' && p[i] <= '9')
+   {
+      if (__builtin_mul_overflow(val, 10ULL, &val) ||
+         __builtin_add_overflow(val, (uint64_t)(p[i] - '0'), &val))
+      {
+         *over = true;
+      }
+      i++;
+   }
+   *v = val;
+   return i;
+} // end scandec
+
+// ----------------- scanint(const char*, size_t, int, uint64_t*, bool*, bool*)
+// Parses an optionally signed integer, like strtoull( ) without the
+//   leading white space
+// Base 0 picks 16 for a 0x prefix, 8 for a leading 0 and 10 otherwise
+//
+// param: p       Text being parsed
+// param: len     Bytes of text available
+// param: base    8, 10, 16 or 0
+// param: mag     Set to the magnitude
+// param: neg     Set if a '-' was read
+// param: over    Set if the magnitude does not fit in 64 bits
+//
+// return: Number of bytes used, 0 if there were no digits
+//
+size_t scanint(const char* p, size_t len, int base, uint64_t* mag, bool* neg,
+   bool* over)
+{
+   size_t i = 0;
+
+   *mag = 0;
+   *neg = false;
+   *over = false;
+   if (i < len && (p[i] == '+' || p[i] == '-'))
+   {
+      *neg = (p[i] == '-');
+      i++;
+   }
+   if ((base == 0 || base == 16) && i + 2 < len && p[i] == '0' &&
+      (p[i + 1] == 'x' || p[i + 1] == 'X') &&
+      (scanclass.cls[(unsigned char)p[i + 2]] & SC_HEX))
+   {
+      base = 16;
+      i += 2;
+   }
+   else if (base == 0)
+   {
+      base = (i < len && p[i] == '0') ? 8 : 10;
+   }
+
+   size_t first = i;                         // First digit
+   if (base == 10)
+   {
+      i += scandec(p + i, len - i, mag, over);
+   }
+   else
+   {
+      for (; i < len; i++)
+      {
+         int c = (unsigned char)p[i];
+         int d = (c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10;
+         if (!(scanclass.cls[c] & SC_HEX) || d >= base)
+         {
+            break;
+         }
+         if (__builtin_mul_overflow(*mag, (uint64_t)base, mag) ||
+            __builtin_add_overflow(*mag, (uint64_t)d, mag))
+         {
+            *over = true;
+         }
+      }
+   }
+   return (i > first) ? i : 0;
+} // end scanint
+
+// ----------------------------------- scandouble(const char*, size_t, double*)
+// Parses a floating-point number
+// Decimal numbers of up to 19 significant digits whose value and power
+//   of ten are both exact in a double are computed with one multiply or
+//   divide, which rounds correctly; anything else goes to strtod( )
+//
+// param: p       Text being parsed
+// param: len     Bytes of text available
+// param: v       Set to the value
+//
+// return: Number of bytes used, 0 if there was no number
+//
+size_t scandouble(const char* p, size_t len, double* v)
+{
+   size_t i = 0;
+   bool neg = false;
+   bool over = false;
+   uint64_t mant = 0;                        // Digits without the point
+
+   if (i < len && (p[i] == '+' || p[i] == '-'))
+   {
+      neg = (p[i] == '-');
+      i++;
+   }
+   size_t ndig = scandec(p + i, len - i, &mant, &over);
+   i += ndig;
+   int exp10 = 0;
+   if (i < len && p[i] == '.')
+   {
+      size_t nfrac = scandec(p + i + 1, len - i - 1, &mant, &over);
+      if (ndig + nfrac > 0)
+      {
+         i += 1 + nfrac;
+      }
+      ndig += nfrac;
+      exp10 = -(int)nfrac;
+   }
+   if (ndig > 0 && i + 1 < len && (p[i] == 'e' || p[i] == 'E'))
+   {
+      size_t j = i + 1;
+      bool eneg = false;
+      if (p[j] == '+' || p[j] == '-')
+      {
+         eneg = (p[j] == '-');
+         j++;
+      }
+      if (j < len && p[j] >= '0' && p[j] <= '9')
+      {
+         int e = 0;
+         for (; j < len && p[j] >= '0' && p[j] <= '9'; j++)
+         {
+            e = (e < 100000) ? e * 10 + (p[j] - '0') : e;
+         }
+         exp10 += eneg ? -e : e;
+         i = j;
+      }
+   }
+
+   if (ndig > 0 && ndig <= 19 && !over && mant <= (1ULL << 53) &&
+      exp10 >= -22 && exp10 <= 22)           // Exact operands, one rounding
+   {
+      double d = (double)mant;
+      d = (exp10 < 0) ? d / exact10s[-exp10] : d * exact10s[exp10];
+      *v = neg ? -d : d;
+      return i;
+   }
+
+   char text[SCAN_TMPSIZE + 1];              // strtod( ) needs a string
+   size_t n = (len < SCAN_TMPSIZE) ? len : SCAN_TMPSIZE;
+   memcpy(text, p, n);
+   text[n] = '\0';
+   char* end;
+   *v = strtod(text, &end);
+   return end - text;
+} // end scandouble
+
+// ------------------------------------------------------------ scanfill(FILE*)
+// Makes sure the stream buffer holds unread data, refilling it if needed
+//
+// param: stream  Pointer to the file object being scanned
+//
+// return: Number of unread bytes in the buffer, 0 at end of file
+//
+ssize_t scanfill(FILE* stream)
+{
+   if (stream->pos < stream->actual_size)
+   {
+      return stream->actual_size - stream->pos;
+   }
+   if (stream->eof)
+   {
+      return 0;
+   }
+   refill(stream);
+   if (stream->pos >= stream->actual_size)
+   {
+      stream->actual_size = stream->pos;
+      stream->eof = true;
+      return 0;
+   }
+   return stream->actual_size - stream->pos;
+} // end scanfill
+
+// -------------------------------------------- scanused(FILE*, size_t, size_t)
+// Consumes the bytes a conversion used from a span found by scanspan( )
+//
+// param: stream  Pointer to the file object being scanned
+// param: used    Bytes of the span the conversion used
+// param: carried Bytes of the span already consumed into tmp
+//
+void scanused(FILE* stream, size_t used, size_t carried)
+{
+   if (used > carried)
+   {
+      stream->pos += used - carried;
+      stream->fpos += used - carried;
+   }
+   stream->lastop = 'r';
+} // end scanused
+
+// ------------------------------------------------------------ scanpeek(FILE*)
+// Returns the next byte of the stream without consuming it
+//
+int scanpeek(FILE* stream)
+{
+   if (scanfill(stream) == 0)
+   {
+      return EOF;
+   }
+   return (unsigned char)stream->buffer[stream->pos];
+} // end scanpeek
+
+// ------------------------------------------------------------ scanskip(FILE*)
+// Consumes white space, refilling as often as needed
+//
+// return: The next byte after it, not consumed, or EOF
+//
+int scanskip(FILE* stream)
+{
+   while (scanfill(stream) > 0)
+   {
+      const char* p = stream->buffer + stream->pos;
+      const char* end = stream->buffer + stream->actual_size;
+      const char* q = p;
+      while (q < end && (scanclass.cls[(unsigned char)*q] & SC_SPACE))
+      {
+         q++;
+      }
+      stream->pos += q - p;
+      stream->fpos += q - p;
+      stream->lastop = 'r';
+      if (q < end)
+      {
+         return (unsigned char)*q;
+      }
+   }
+   return EOF;
+} // end scanskip
+
+// ---------------------- scanspan(FILE*, int, size_t, char*, size_t*, size_t*)
+// Finds the run of bytes in the classes mask at the stream position
+// A run that ends inside the buffer is returned in place and nothing is
+//   consumed; a run that reaches the end of the buffer is carried into tmp
+//   (consuming it) and continued after a refill( )
+//
+// param: stream  Pointer to the file object being scanned
+// param: mask    SC_ classes the run may contain
+// param: max     Longest run wanted
+// param: tmp     SCAN_TMPSIZE bytes for a run that crosses a refill
+// param: len     Set to the length of the run
+// param: carried Set to the number of its bytes already consumed
+//
+// return: Start of the run, in the buffer or tmp
+//
+const char* scanspan(FILE* stream, int mask, size_t max, char* tmp,
+   size_t* len, size_t* carried)
+{
+   size_t seen = 0;                          // Bytes of the run so far
+   size_t got = 0;                           // Bytes carried into tmp
+
+   *carried = 0;
+   while (scanfill(stream) > 0)
+   {
+      const char* p = stream->buffer + stream->pos;
+      size_t avail = stream->actual_size - stream->pos;
+      size_t n = 0;
+      while (n < avail && seen + n < max &&
+         (scanclass.cls[(unsigned char)p[n]] & mask))
+      {
+         n++;
+      }
+      size_t take = (n < SCAN_TMPSIZE - got) ? n : SCAN_TMPSIZE - got;
+
+      if (n < avail || seen + n == max || stream->eof) // Run ends here
+      {
+         if (got == 0)                       // Whole run in place
+         {
+            *len = n;
+            return p;
          }
-         stream->fpos += stream->actual_size;         // Advance file position
-         return (int)c;
+         memcpy(tmp + got, p, take);
+         *len = got + take;
+         return tmp;
       }
 
-      else
+      memcpy(tmp + got, p, take);            // Runs off the end, carry it
+      got += take;
+      seen += n;
+      stream->pos += n;
+      stream->fpos += n;
+      stream->lastop = 'r';
+      *carried = got;
+   }
+   *len = got;
+   return tmp;
+} // end scanspan
+
+// ------------ scancopy(FILE*, char*, size_t, const unsigned char*, int, bool)
+// Copies bytes from the stream while they are (want) or are not (!want)
+//   in the classes mask of table, refilling as needed
+//
+// param: stream  Pointer to the file object being scanned
+// param: dst     Where the bytes go, NULL to discard them
+// param: max     Most bytes to copy
+// param: table   Class of every byte, indexed by unsigned byte
+// param: mask    Classes tested
+// param: want    Whether bytes in the classes are copied or stop the copy
+//
+// return: Number of bytes consumed
+//
+size_t scancopy(FILE* stream, char* dst, size_t max, const unsigned char* table,
+   int mask, bool want)
+{
+   size_t done = 0;
+
+   while (done < max && scanfill(stream) > 0)
+   {
+      const char* p = stream->buffer + stream->pos;
+      size_t avail = stream->actual_size - stream->pos;
+      if (avail > max - done)
       {
-         return -1;
+         avail = max - done;
+      }
+      size_t n = 0;
+      while (n < avail && ((table[(unsigned char)p[n]] & mask) != 0) == want)
+      {
+         n++;
+      }
+      if (dst != NULL)
+      {
+         memcpy(dst + done, p, n);
+      }
+      done += n;
+      stream->pos += n;
+      stream->fpos += n;
+      stream->lastop = 'r';
+      if (n < avail)                         // Stopped on a byte
+      {
+         break;
       }
    }
-   if (stream->lastop == 'w')                         // Flush written data
+   return done;
+} // end scancopy
+
+// ----------------------------------------------------------- scanready(FILE*)
+// Checks a stream can be scanned and flushes any written data
+//
+// return: 0 if it can, -1 otherwise
+//
+int scanready(FILE* stream)
+{
+   if (stream == nullptr)                    // Parameter validation
    {
-      fflush(stream);
+      printf("Null file parameter");
+      return -1;
    }
-   if (stream->eof && stream->pos == stream->actual_size)// Out of data
-   {
-      fpurge(stream);
+   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
+      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))
+   {                                         // Permissions check
+      printf("Read permissions not granted\n");
       return -1;
    }
-   if (stream->pos == stream->actual_size ||
-      stream->lastop == 0)                            // Buffer empty/used up
-   {
-      refill(stream);
+   if (stream->size == 0 || stream->mode == _IONBF)
+   {                                         // Nothing to look ahead in
+      printf("Buffered stream required\n");
+      return -1;
    }
-
-   char c;                                            // char to return
-   char* sbuf = stream->buffer + stream->pos;         // Current buff position
-
-   memcpy(&c, sbuf, 1);                               // Get char
-   stream->pos++;                                     // Advance buff pos
-   stream->fpos++;                                    // Advance file pos
-   stream->lastop = 'r';
-
-   if (stream->eof && stream->pos == stream->actual_size)
+   if (stream->lastop == 'w')                // Flush written data
    {
-      fpurge(stream);                                 // Clear used up buffer
+      fflush_unlocked(stream);
    }
+   return 0;
+} // end scanready
 
-   return (int)c;
-} // end fgetc
-
-// ---------------------------------------------------------- fputc(int, FILE*)
-// Writes a single char into the file
-// 
-// param: stream  Pointer to the file object being written to
-// param: inputChar  char to write to the file
-// 
-// pre:    The file has been initialized an opened
-// post:   inputChar will exist in the file data
-// return: char that was input (inputChar parameter)
+// -------------------------------------- fread_int64_unlocked(FILE*, int64_t*)
+// Reads a decimal integer, skipping white space before it
+// Values out of range are clamped to INT64_MIN / INT64_MAX
+// The caller must hold the stream lock, see flockfile( )
 //
-int fputc(int inputChar, FILE* stream)
+// param: stream  Pointer to the file object being read from
+// param: out     Set to the value read
+//
+// pre:    The file has been opened for reading with a buffer
+// post:   The stream is positioned after the number
+// return: 1 if a number was read, 0 if the next text is not a number,
+//           EOF at end of file or on error
+//
+int fread_int64_unlocked(FILE* stream, int64_t* out)
 {
-   if (stream->flag == O_RDONLY)                // Permissions check
+   if (scanready(stream) == -1 || out == nullptr || scanskip(stream) == EOF)
    {
-      printf("Write permissions not granted\n");
-      return -1;
+      return EOF;
    }
-   if (stream->flag == (O_WRONLY | O_CREAT | O_APPEND) ||
-      stream->flag == (O_RDWR | O_CREAT | O_APPEND))// Append check
+
+   char tmp[SCAN_TMPSIZE];
+   size_t len, carried;
+   const char* p = scanspan(stream, SC_DIGIT | SC_SIGN, SIZE_MAX, tmp, &len,
+      &carried);
+   uint64_t mag;
+   bool neg, over;
+   size_t used = scanint(p, len, 10, &mag, &neg, &over);
+   scanused(stream, used, carried);
+   if (used == 0)
    {
-      stream->fpos = lseek(stream->fd, 0, SEEK_END);
+      return 0;
    }
-   if (stream == nullptr)                       // Parameter validation
+
+   if (neg)
    {
-      printf("Null file parameter");
-      return -1;
+      *out = (over || mag > (uint64_t)INT64_MAX + 1) ? INT64_MIN
+         : (int64_t)(0 - mag);
    }
-   if (inputChar < 0)                           // Parameter validation
+   else
    {
-      printf("Invalid char parameter");
-      return -1;
+      *out = (over || mag > (uint64_t)INT64_MAX) ? INT64_MAX : (int64_t)mag;
    }
-   if (stream->mode == _IONBF)                  // No-buffer check
+   return 1;
+} // end fread_int64_unlocked
+
+// ----------------------------------------------- fread_int64(FILE*, int64_t*)
+// Locks the stream around fread_int64_unlocked( )
+//
+int fread_int64(FILE* stream, int64_t* out)
+{
+   flockfile(stream);
+   int result = fread_int64_unlocked(stream, out);
+   funlockfile(stream);
+   return result;
+} // end fread_int64
+
+// -------------------------------------- fread_double_unlocked(FILE*, double*)
+// Reads a floating-point number, skipping white space before it
+// Accepts what strtod( ) accepts apart from hexadecimal floats
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being read from
+// param: out     Set to the value read
+//
+// pre:    The file has been opened for reading with a buffer
+// post:   The stream is positioned after the number
+// return: 1 if a number was read, 0 if the next text is not a number,
+//           EOF at end of file or on error
+//
+int fread_double_unlocked(FILE* stream, double* out)
+{
+   if (scanready(stream) == -1 || out == nullptr || scanskip(stream) == EOF)
    {
-      write(stream->fd, &inputChar, 1);
-      return inputChar;
+      return EOF;
    }
-   if (stream->lastop == 'r')                   // Purge if last op was read
+
+   char tmp[SCAN_TMPSIZE];
+   size_t len, carried;
+   const char* p = scanspan(stream, SC_FLOAT, SIZE_MAX, tmp, &len, &carried);
+   size_t used = scandouble(p, len, out);
+   scanused(stream, used, carried);
+   return (used > 0) ? 1 : 0;
+} // end fread_double_unlocked
+
+// ----------------------------------------------- fread_double(FILE*, double*)
+// Locks the stream around fread_double_unlocked( )
+//
+int fread_double(FILE* stream, double* out)
+{
+   flockfile(stream);
+   int result = fread_double_unlocked(stream, out);
+   funlockfile(stream);
+   return result;
+} // end fread_double
+
+// --------------------------------- fread_token_unlocked(FILE*, char*, size_t)
+// Reads the next run of non-white-space bytes, skipping white space first
+// A token longer than size - 1 bytes is split, the rest is read next time
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being read from
+// param: buf     User buffer, '\0' terminated on return
+// param: size    Size of the user buffer
+//
+// pre:    The file has been opened for reading with a buffer
+// post:   The stream is positioned after the token
+// return: Length of the token, EOF at end of file or on error
+//
+int fread_token_unlocked(FILE* stream, char* buf, size_t size)
+{
+   if (scanready(stream) == -1 || buf == nullptr || size < 2 ||
+      scanskip(stream) == EOF)
    {
-      fpurge(stream);
+      return EOF;
    }
-   if (stream->pos == stream->size)             // Flush if buffer is filled
+
+   size_t n = scancopy(stream, buf, size - 1, scanclass.cls, SC_SPACE, false);
+   buf[n] = '\0';
+   return n;
+} // end fread_token_unlocked
+
+// ------------------------------------------ fread_token(FILE*, char*, size_t)
+// Locks the stream around fread_token_unlocked( )
+//
+int fread_token(FILE* stream, char* buf, size_t size)
+{
+   flockfile(stream);
+   int result = fread_token_unlocked(stream, buf, size);
+   funlockfile(stream);
+   return result;
+} // end fread_token
+
+// -------------------------------------------- scanstore(void*, int, uint64_t)
+// Stores a converted integer through a pointer of the size its length
+//   modifier names
+//
+// param: dst     Pointer from the argument list
+// param: lng     -2 hh, -1 h, 0 none, 1 l, 2 ll, 3 z / j / t
+// param: v       Value, already in two's complement
+//
+void scanstore(void* dst, int lng, uint64_t v)
+{
+   switch (lng)
    {
-      fflush(stream);
+   case -2: *(char*)dst = (char)v; break;
+   case -1: *(short*)dst = (short)v; break;
+   case 0: *(int*)dst = (int)v; break;
+   case 1: *(long*)dst = (long)v; break;
+   case 2: *(long long*)dst = (long long)v; break;
+   default: *(size_t*)dst = (size_t)v; break;
    }
+} // end scanstore
 
-   char* sbuf = stream->buffer + stream->pos;   // Point to current position in buffer
-   memcpy(sbuf, &inputChar, 1);
-   stream->pos++;
-   stream->fpos++;
+// ------------------------------ vfscanf_unlocked(FILE*, const char*, va_list)
+// Reads formatted input, parsing straight out of the stream buffer
+// Supports white space and literal text, assignment suppression (*),
+//   field widths, the length modifiers hh h l ll z j t L, and the
+//   conversions d i u o x X f F e E g G a A s c [ n %
+// Decimal integers and doubles use the fast paths of fread_int64( ) and
+//   fread_double( )
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being read from
+// param: format  Format string
+// param: list    Pointers receiving the conversions
+//
+// pre:    The file has been opened for reading with a buffer
+// return: Number of conversions assigned, EOF if the input ended or an
+//           error occurred before the first conversion
+//
+int vfscanf_unlocked(FILE* stream, const char* format, va_list list)
+{
+   if (format == nullptr || scanready(stream) == -1)
+   {
+      return EOF;
+   }
 
-   stream->lastop = 'w';
-   if (stream->pos == stream->size)
+   off_t start = stream->fpos;               // For %n
+   int assigned = 0;                         // Conversions stored
+   bool converted = false;                   // Any conversion completed
+   const char* f = format;
+
+   while (*f != '\0')
    {
-      fflush(stream);                           // Flush if buffer is filled
+      if (scanclass.cls[(unsigned char)*f] & SC_SPACE) // Skip white space
+      {
+         scanskip(stream);
+         f++;
+         continue;
+      }
+      if (*f != '%' || f[1] == '%')          // Literal byte must match
+      {
+         if (*f == '%')
+         {
+            f++;
+            scanskip(stream);
+         }
+         int c = scanpeek(stream);
+         if (c == EOF)
+         {
+            return converted ? assigned : EOF;
+         }
+         if (c != (unsigned char)*f)
+         {
+            return assigned;
+         }
+         scanused(stream, 1, 0);
+         f++;
+         continue;
+      }
+      f++;
+
+      bool skip = (*f == '*');               // Assignment suppression
+      if (skip)
+      {
+         f++;
+      }
+      size_t width = 0;                      // 0 for no limit
+      while (*f >= '0' && *f <= '9')
+      {
+         width = width * 10 + (*f++ - '0');
+      }
+      int lng = 0;                           // Length modifier
+      bool ldbl = false;
+      if (*f == 'h')
+      {
+         lng = (f[1] == 'h') ? -2 : -1;
+         f += (f[1] == 'h') ? 2 : 1;
+      }
+      else if (*f == 'l')
+      {
+         lng = (f[1] == 'l') ? 2 : 1;
+         f += (f[1] == 'l') ? 2 : 1;
+      }
+      else if (*f == 'z' || *f == 'j' || *f == 't')
+      {
+         lng = 3;
+         f++;
+      }
+      else if (*f == 'L')
+      {
+         ldbl = true;
+         f++;
+      }
+
+      char conv = *f;
+      if (conv == '\0')
+      {
+         break;
+      }
+      f++;
+      if (conv != 'c' && conv != '[' && conv != 'n' &&
+         scanskip(stream) == EOF)            // Leading white space
+      {
+         return converted ? assigned : EOF;
+      }
+      size_t max = (width > 0) ? width : SIZE_MAX;
+
+      switch (conv)
+      {
+      case 'n':
+         if (!skip)
+         {
+            scanstore(va_arg(list, void*), lng, stream->fpos - start);
+         }
+         continue;
+      case 'd':
+      case 'i':
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+      {
+         int base = (conv == 'd' || conv == 'u') ? 10 : (conv == 'o') ? 8
+            : (conv == 'i') ? 0 : 16;
+         char tmp[SCAN_TMPSIZE];
+         size_t len, carried;
+         const char* p = scanspan(stream, (base == 10)
+            ? SC_DIGIT | SC_SIGN : SC_HEX | SC_SIGN | SC_XMARK, max, tmp,
+            &len, &carried);
+         uint64_t mag;
+         bool neg, over;
+         size_t used = scanint(p, len, base, &mag, &neg, &over);
+         scanused(stream, used, carried);
+         if (used == 0)
+         {
+            return converted ? assigned : (scanpeek(stream) == EOF) ? EOF
+               : assigned;
+         }
+         converted = true;
+         if (!skip)
+         {
+            scanstore(va_arg(list, void*), lng, neg ? 0 - mag : mag);
+            assigned++;
+         }
+         continue;
+      }
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+      {
+         char tmp[SCAN_TMPSIZE];
+         size_t len, carried;
+         const char* p = scanspan(stream, SC_FLOAT, max, tmp, &len, &carried);
+         double v;
+         size_t used = scandouble(p, len, &v);
+         scanused(stream, used, carried);
+         if (used == 0)
+         {
+            return assigned;
+         }
+         converted = true;
+         if (!skip)
+         {
+            if (ldbl)
+            {
+               *va_arg(list, long double*) = v;
+            }
+            else if (lng == 1)
+            {
+               *va_arg(list, double*) = v;
+            }
+            else
+            {
+               *va_arg(list, float*) = (float)v;
+            }
+            assigned++;
+         }
+         continue;
+      }
+      case 's':
+      case 'c':
+      case '[':
+      {
+         unsigned char set[256];             // Members of a %[ set
+         const unsigned char* table = scanclass.cls;
+         int mask = SC_SPACE;
+         bool want = false;                  // %s stops at white space
+         if (conv == 'c')
+         {
+            mask = 0;                        // %c takes every byte
+            max = (width > 0) ? width : 1;
+         }
+         else if (conv == '[')
+         {
+            want = (*f != '^');
+            if (!want)
+            {
+               f++;
+            }
+            memset(set, 0, sizeof(set));
+            if (*f == ']')                   // Leading ] is a member
+            {
+               set[(unsigned char)*f++] = 1;
+            }
+            while (*f != '\0' && *f != ']')
+            {
+               if (f[1] == '-' && f[2] != ']' && f[2] != '\0') // Range
+               {
+                  for (int c = (unsigned char)f[0]; c <= (unsigned char)f[2];
+                     c++)
+                  {
+                     set[c] = 1;
+                  }
+                  f += 3;
+               }
+               else
+               {
+                  set[(unsigned char)*f++] = 1;
+               }
+            }
+            if (*f == ']')
+            {
+               f++;
+            }
+            table = set;
+            mask = 1;
+         }
+
+         char* dst = skip ? NULL : va_arg(list, char*);
+         size_t n = scancopy(stream, dst, max, table, mask, want);
+         if (n == 0)
+         {
+            return (scanpeek(stream) == EOF && !converted) ? EOF : assigned;
+         }
+         converted = true;
+         if (!skip)
+         {
+            if (conv != 'c')
+            {
+               dst[n] = '\0';
+            }
+            assigned++;
+         }
+         continue;
+      }
+      default:                               // Unknown conversion
+         return assigned;
+      }
    }
 
-   return inputChar;
-} // end fputc
+   return assigned;
+} // end vfscanf_unlocked
 
-// --------------------------------------------------- fgets(char*, int, FILE*)
-// Read a string from the file/buffer
-// Up to parameter-dictated size of bytes
-// Returns a series of bytes ending in '\0'
-// 
-// param: str     User's string buffer
-// param: size    Max size of user buffer
+// -------------------------------------------- fscanf(FILE*, const char*, ...)
+// Locks the stream around vfscanf_unlocked( )
+//
+int fscanf(FILE* stream, const char* format, ...)
+{
+   va_list list;
+   va_start(list, format);
+
+   flockfile(stream);
+   int result = vfscanf_unlocked(stream, format, list);
+   funlockfile(stream);
+
+   va_end(list);
+   return result;
+} // end fscanf
+
+// ------------------------------------------------------------ reccarry(FILE*)
+// Moves the unread tail of the buffer to its start and reads more data
+//   behind it, so a record split by the end of the buffer becomes whole
+//
 // param: stream  Pointer to the file object being read from
-// 
-// pre:    File has been opened and initialized
-// post:   The next string of bytes in the file is read
-// return: The string of bytes read from the file
 //
-char* fgets(char* str, int size, FILE* stream)
+// pre:    The buffer holds no complete record and EOF is not set
+// post:   pos is 0 and the buffer holds the tail plus what was read
+// return: 0 on success, -1 if the tail already fills the buffer
+//
+int reccarry(FILE* stream)
 {
-   if (stream->flag == (O_WRONLY | O_CREAT | O_TRUNC) ||
-      stream->flag == (O_WRONLY | O_CREAT | O_APPEND))
-   {                                // Permissions check
-      printf("Read permissions not granted\n");
-      return NULL;
+   ssize_t keep = stream->actual_size - stream->pos; // Partial record
+   if (keep >= stream->size || stream->lz != NULL || stream->direct)
+   {                                         // Blocks cannot be joined
+      return -1;
    }
-   if (stream == nullptr)           // Parameter validation
+   if (stream->ra != NULL)                   // Plain reads use the fd
    {
-      printf("Null file parameter");
-      return NULL;
+      ra_sync(stream);
    }
-   if (size < 0)                    // Parameter validation
+
+   memmove(stream->buffer, stream->buffer + stream->pos, keep);
+   STAT_ADD(stream, refills, 1);
+   ssize_t got = io_read(stream, stream->buffer + keep, stream->size - keep);
+   stream->pos = 0;
+   stream->actual_size = keep + ((got > 0) ? got : 0);
+   if (got == -1)
    {
-      printf("Invalid size parameter");
-      return NULL;
+      printf("Error in reading file\n");
    }
-   if (stream->eof && stream->pos == stream->actual_size)
-   {                                // Out of data
-      return NULL;
+   if (got < stream->size - keep)            // Short read, as refill( )
+   {
+      stream->eof = true;
+   }
+   return 0;
+} // end reccarry
+
+// ----------------------------------------------- reclong(FILE*, char, size_t)
+// Collects one record too large for the stream buffer in the line buffer
+//
+// param: stream  Pointer to the file object being read from
+// param: delim   Delimiter ending the record, ignored if reclen > 0
+// param: reclen  Length of a fixed-width record, 0 for delimited records
+//
+// post:   The stream is positioned after the record and its delimiter
+// return: Length of the record in the line buffer
+//
+size_t reclong(FILE* stream, char delim, size_t reclen)
+{
+   size_t len = 0;
+
+   while (scanfill(stream) > 0)
+   {
+      char* sbuf = stream->buffer + stream->pos;
+      size_t avail = stream->actual_size - stream->pos;
+      const char* d = NULL;
+      size_t n = avail;
+      if (reclen > 0)
+      {
+         n = (avail < reclen - len) ? avail : reclen - len;
+      }
+      else if ((d = scanchr(sbuf, avail, delim)) != NULL)
+      {
+         n = d - sbuf;
+      }
+
+      if (growline(stream, len + n) == -1)
+      {
+         break;
+      }
+      memcpy(stream->ln->buf + len, sbuf, n);
+      len += n;
+      n += (d != NULL) ? 1 : 0;              // Consume the delimiter too
+      stream->pos += n;
+      stream->fpos += n;
+      stream->lastop = 'r';
+      if (d != NULL || (reclen > 0 && len == reclen))
+      {
+         break;
+      }
    }
-   if (stream->lastop == 'w')       // Flush written data
+   return len;
+} // end reclong
+
+// ------------------------ frecords(FILE*, char, size_t, record_view*, size_t)
+// Shared body of fread_records( ) and fread_records_fixed( )
+//
+size_t frecords(FILE* stream, char delim, size_t reclen,
+   struct record_view* out, size_t max)
+{
+   if (out == nullptr || max == 0 || scanready(stream) == -1)
    {
-      fflush(stream);
+      return 0;
    }
 
-   char c;                          // Last char read
-   char* strcur = str;              // Current user buff position
-   int i = 0;                       // Size (bytes) read
+   while (scanfill(stream) > 0)
+   {
+      char* start = stream->buffer + stream->pos;
+      const char* p = start;
+      const char* end = stream->buffer + stream->actual_size;
+      size_t n = 0;                          // Records found
 
-   while ((c = fgetc(stream)) != EOF && c != '\n')
-   {                 // Loop until EOF, new line, or user buff size is reached
-      if (i < (size - 2))
+      if (reclen > 0)                        // Fixed width, no scan needed
       {
-         *strcur = c;
-         strcur++;
-         i++;
+         size_t whole = (end - p) / reclen;
+         n = (whole < max) ? whole : max;
+         for (size_t i = 0; i < n; i++, p += reclen)
+         {
+            out[i].data = p;
+            out[i].len = reclen;
+         }
       }
-      else                          // User buffer size - 1 reached
+      else
       {
-         *strcur = c;
-         strcur++;
-         break;
+         const char* d;
+         while (n < max && (d = scanchr(p, end - p, delim)) != NULL)
+         {
+            out[n].data = p;
+            out[n++].len = d - p;
+            p = d + 1;
+         }
+      }
+      stream->pos += p - start;
+      stream->fpos += p - start;
+      stream->lastop = 'r';
+      if (n > 0)                             // Partial record waits its turn
+      {
+         return n;
+      }
+
+      if (stream->eof)                       // Last record has no end
+      {
+         out[0].data = p;
+         out[0].len = end - p;
+         stream->pos = stream->actual_size;
+         stream->fpos += end - p;
+         return 1;
+      }
+      if (reccarry(stream) == -1)            // Bigger than the buffer
+      {
+         out[0].len = reclong(stream, delim, reclen);
+         out[0].data = (stream->ln != NULL) ? stream->ln->buf : NULL;
+         return 1;
       }
    }
-   stream->lastop = 'r';
+   return 0;
+} // end frecords
+
+// ------------------ fread_records_unlocked(FILE*, char, record_view*, size_t)
+// Returns views of every complete record in the stream buffer, up to max
+// Records are found with scanchr( ) and are not copied; a record split by
+//   the end of the buffer is moved to its front and completed by the next
+//   read, so it is returned whole by the next call
+// A record larger than the buffer is collected in the line buffer
+// The final record of the file is returned even without a delimiter
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being read from
+// param: delim   Byte ending each record, not included in the views
+// param: out     Filled with up to max views
+// param: max     Size of out
+//
+// pre:    The file has been opened for reading with a buffer
+// post:   The stream is positioned after the last record returned
+// return: Number of views filled, 0 at end of file or on error
+//
+size_t fread_records_unlocked(FILE* stream, char delim, struct record_view* out,
+   size_t max)
+{
+   return frecords(stream, delim, 0, out, max);
+} // end fread_records_unlocked
 
-   if (i == size - 2)               // Add final char to fill user buffer
+// --------------------------- fread_records(FILE*, char, record_view*, size_t)
+// Locks the stream around fread_records_unlocked( )
+// The views stay valid after the lock is released, until the next
+//   operation on the stream
+//
+size_t fread_records(FILE* stream, char delim, struct record_view* out,
+   size_t max)
+{
+   flockfile(stream);
+   size_t result = fread_records_unlocked(stream, delim, out, max);
+   funlockfile(stream);
+   return result;
+} // end fread_records
+
+// ---------- fread_records_fixed_unlocked(FILE*, size_t, record_view*, size_t)
+// Returns views of every complete fixed-width record in the stream
+//   buffer, up to max, like fread_records_unlocked( )
+// A short final record is returned with its actual length
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being read from
+// param: reclen  Length of every record, at least 1
+// param: out     Filled with up to max views
+// param: max     Size of out
+//
+// pre:    The file has been opened for reading with a buffer
+// post:   The stream is positioned after the last record returned
+// return: Number of views filled, 0 at end of file or on error
+//
+size_t fread_records_fixed_unlocked(FILE* stream, size_t reclen,
+   struct record_view* out, size_t max)
+{
+   if (reclen == 0)                          // Parameter validation
    {
-      *strcur = fgetc(stream);
-      strcur++;
-   }
-   else if (*--strcur != '\n')      // Append \n if needed
-   {                                // Otherwise write() overwrites its outputs
-      *++strcur = '\n';
-      *++strcur = '\0';
+      printf("Invalid record length\n");
+      return 0;
    }
+   return frecords(stream, 0, reclen, out, max);
+} // end fread_records_fixed_unlocked
 
-   return str;
-} // end fgets
+// ------------------- fread_records_fixed(FILE*, size_t, record_view*, size_t)
+// Locks the stream around fread_records_fixed_unlocked( )
+//
+size_t fread_records_fixed(FILE* stream, size_t reclen,
+   struct record_view* out, size_t max)
+{
+   flockfile(stream);
+   size_t result = fread_records_fixed_unlocked(stream, reclen, out, max);
+   funlockfile(stream);
+   return result;
+} // end fread_records_fixed
 
-// -------------------------------------------------- fputs(const char*, FILE*)
+// ----------------------------------------- fputs_unlocked(const char*, FILE*)
 // Writes a string into the file
+// The string is measured once and handed to fwrite(), so it is copied
+//   into the stream buffer in at most two pieces and only flushed at
+//   buffer boundaries
+// The caller must hold the stream lock, see flockfile( )
 // 
 // param: str     User string to be written
 // param: stream  Pointer to the file object being written to
 // 
 // pre:    File has been opened and initialized
-// post:   Data in user buffer has been written to the file
-// return: Number of bytes written
+// post:   Data in user buffer has been buffered or written to the file
+// return: Number of bytes written, -1 on error
 //
-int fputs(const char* str, FILE* stream)
+int fputs_unlocked(const char* str, FILE* stream)
 {
+   if (stream == nullptr || str == nullptr)           // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return -1;
+   }
    if (stream->flag == O_RDONLY)                      // Permissions check
    {
       printf("Write permissions not granted\n");
       return -1;
    }
-   if (stream == nullptr || str == nullptr)           // Parameter validation
+
+   size_t len = strlen(str);                          // Measure string once
+   if (len == 0)
+   {
+      return 0;
+   }
+
+   size_t written = fwrite_unlocked(str, 1, len, stream); // Bulk copy / write
+   if (written == (size_t)-1)
+   {
+      return -1;
+   }
+   return written;
+} // end fputs_unlocked
+
+// -------------------------------------------------- fputs(const char*, FILE*)
+// Locks the stream around fputs_unlocked( )
+//
+int fputs(const char* str, FILE* stream)
+{
+   flockfile(stream);
+   int result = fputs_unlocked(str, stream);
+   funlockfile(stream);
+   return result;
+} // end fputs
+
+// -------------------------------------------------------- spillfile(fmtsink*)
+// Drains an fprintf( ) sink that formats straight into the stream buffer
+//
+void spillfile(fmtsink* out)
+{
+   out->stream->fpos += out->len - out->stream->pos; // Keep fpos current
+   out->stream->pos = out->len;
+   out->stream->lastop = 'w';
+   fflush_unlocked(out->stream);
+   out->len = out->stream->pos;
+} // end spillfile
+
+// ------------------------------------------------------- spillwrite(fmtsink*)
+// Drains an fprintf( ) sink staged on the stack for an unbuffered stream
+//
+void spillwrite(fmtsink* out)
+{
+   fwrite_unlocked(out->buf, 1, out->len, out->stream);
+   out->len = 0;
+} // end spillwrite
+
+// ----------------------------- vfprintf_unlocked(FILE*, const char*, va_list)
+// Writes formatted output to a file
+// Buffered streams are formatted directly into the stream buffer, which
+//   is flushed only when it fills, like fwrite( )
+// Unbuffered streams are formatted on the stack and written at the end
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being written to
+// param: format  Format string, see vformat( )
+// param: list    Arguments for the conversions
+//
+// pre:    File has been opened and initialized
+// post:   Formatted output has been buffered or written to the file
+// return: Number of bytes produced, -1 on error
+//
+int vfprintf_unlocked(FILE* stream, const char* format, va_list list)
+{
+   if (stream == nullptr || format == nullptr)        // Parameter validation
    {
       printf("Null pointer parameter");
       return -1;
    }
-   if (stream->flag == (O_WRONLY | O_CREAT | O_APPEND) ||
-      stream->flag == (O_RDWR | O_CREAT | O_APPEND))  // Append check
+   if (stream->flag == O_RDONLY)                      // Permissions check
    {
-      stream->fpos = lseek(stream->fd, 0, SEEK_END);
+      printf("Write permissions not granted\n");
+      return -1;
    }
-   if (stream->mode == _IONBF)                        // No-buffer check
+
+   if (stream->flag & O_APPEND)                       // O_APPEND places data
    {
-      return write(stream->fd, str, strlen(str));
+      stream->astale = true;
    }
 
-   char c;                                            // char in user string
-   int i = 0;                                         // chars written
+   int nWritten;
 
-   while ((c = fputc(str[i], stream)) != '\0' && c != '\n')
+   if (stream->size == 0 || stream->mode == _IONBF)   // No buffer
    {
-      i++;                 // Write 1 char at a time until end of user string
+      char buf[1024];
+      fmtsink out = { buf, sizeof(buf), 0, 0, spillwrite, stream };
+      nWritten = vformat(&out, format, list);
+      if (out.len > 0)
+      {
+         spillwrite(&out);
+      }
    }
+   else
+   {
+      if (stream->lastop == 'r')                      // Purge after reads
+      {
+         fpurge_unlocked(stream);
+      }
+      if (stream->buffer == (char*)0 && bufalloc(stream) == -1)
+      {                                               // First write
+         return -1;
+      }
 
-   return i;
-} // end fputs
+      fmtsink out = { stream->buffer, (size_t)stream->size,
+         (size_t)stream->pos, 0, spillfile, stream };
+      nWritten = vformat(&out, format, list);
+      stream->fpos += out.len - stream->pos;
+      stream->pos = out.len;
+      stream->lastop = 'w';
+      markdirty(stream);
+      if (flushline(stream, nWritten) == -1)        // Complete lines go out
+      {
+         return -1;
+      }
+   }
+
+   return nWritten;
+} // end vfprintf_unlocked
+
+// ------------------------------------------- fprintf(FILE*, const char*, ...)
+// Locks the stream around vfprintf_unlocked( )
+//
+int fprintf(FILE* stream, const char* format, ...)
+{
+   va_list list;
+   va_start(list, format);
+
+   flockfile(stream);
+   int result = vfprintf_unlocked(stream, format, list);
+   funlockfile(stream);
+
+   va_end(list);
+   return result;
+} // end fprintf
 
 // ---------------------------------------------------------------- feof(FILE*)
 // Returns whether EOF has been reached for the file
@@ -853,69 +6577,342 @@ int feof(FILE* stream)
    return stream->eof == true;
 } // end feof
 
-// ---------------------------------------------------- fseek(FILE*, long, int)
+// ----------------------------------------------------- fstats(FILE*, fstats*)
+// Copies a stream's I/O counters
+// The counters only exist when the library is built with STDIO_STATS
+//
+// param: stream  Pointer to the file object being inspected
+// param: st      Filled with the stream's counters
+//
+// pre:    File has been opened and initialized
+// return: 0 on success, -1 on error or when built without STDIO_STATS
+//
+int fstats(FILE* stream, struct fstats* st)
+{
+   if (stream == nullptr || st == nullptr)         // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return -1;
+   }
+
+#ifdef STDIO_STATS
+   flockfile(stream);
+   *st = stream->stats;
+   funlockfile(stream);
+   return 0;
+#else
+   memset(st, 0, sizeof(*st));
+   return -1;
+#endif
+} // end fstats
+
+// -------------------------------------------------------- fstats_dumpall(int)
+// Writes one line of counters for every open stream to a descriptor
+//
+// param: fd      Descriptor the report is written to
+//
+// return: Number of streams reported, -1 when built without STDIO_STATS
+//
+int fstats_dumpall(int fd)
+{
+#ifdef STDIO_STATS
+   int count = 0;
+   char line[512];
+
+   pthread_mutex_lock(&streamlock);
+   for (FILE* stream = openstreams; stream != NULL; stream = stream->next)
+   {
+      struct fstats* st = &stream->stats;
+      int len = snprintf(line, sizeof(line),
+         "fd=%d read=%lu/%llu write=%lu/%llu lseek=%lu refill=%lu "
+         "flush=%lu purge=%lu hit=%lu miss=%lu syscall_ns=%llu\n",
+         stream->fd, st->reads, st->bytes_read, st->writes,
+         st->bytes_written, st->seeks, st->refills, st->flushes,
+         st->purges, st->hits, st->misses, st->syscall_ns);
+      writeall(fd, line, (len < (int)sizeof(line)) ? len : sizeof(line) - 1);
+      count++;
+   }
+   pthread_mutex_unlock(&streamlock);
+   return count;
+#else
+   (void)fd;
+   return -1;
+#endif
+} // end fstats_dumpall
+
+// ----------------------------------------------------------- appendpos(FILE*)
+// Reads an append stream's position back from the kernel
+// Append writes are placed by O_APPEND rather than a seek, and other
+//   writers may append too, so fpos is only trusted again once resolved
+// Pending data is counted, since it will land at the current end
+// The caller must hold the stream lock, see flockfile( )
+//
+// param: stream  Pointer to the file object being checked
+//
+// pre:    File has been opened and initialized
+// post:   fpos is the offset of the stream's next byte, if it was stale
+//
+void appendpos(FILE* stream)
+{
+   if (!stream->astale || stream->lastop == 'r')   // Position still tracked
+   {
+      return;
+   }
+
+   off_t end = io_lseek(stream, 0, SEEK_END);      // Where O_APPEND writes go
+   if (end == -1)
+   {
+      return;
+   }
+   stream->fsize = end;
+   stream->fpos = end + ((stream->lastop == 'w') ? stream->pos : 0);
+   stream->astale = false;
+} // end appendpos
+
+// ------------------------------------------ fseek_unlocked(FILE*, off_t, int)
 // Moves the current position within the file as dictated by the parameters
-// Negative offset results in moving backwards
-// Final position is offset + whence in the file
+// Final position is offset + the start (SEEK_SET), the current position
+//   (SEEK_CUR) or the end of the file (SEEK_END)
+// A target inside the data already in the read buffer only moves pos,
+//   with no system call
+// Otherwise the buffer is dropped and the descriptor moved with one lseek
+// The file size is cached, kept current by this stream's own writes, and
+//   re-read for every SEEK_END and when the target lands at or past the
+//   cached end, so a file grown by others is seen
 // Sets EOF field to its correct value
 // Allows repositioning past the end of the file
+// The caller must hold the stream lock, see flockfile( )
 // 
 // param: stream  Pointer to the file object being repositioned
+// param: offset  Distance to move, negative moves backwards
+// param: whence  SEEK_SET, SEEK_CUR or SEEK_END
 // 
 // pre:    File has been opened and initialized
 // post:   File position is at indicated location
 // return: 0 on success, -1 on error
 //
-int fseek(FILE* stream, long offset, int whence)
+int fseek_unlocked(FILE* stream, off_t offset, int whence)
 {
    if (stream == nullptr)                          // Parameter validation
    {
       printf("Null file parameter");
       return -1;
    }
-   if (whence < 0)                                 // Parameter validation
-   {
-      printf("Starting point must be >= 0");
+   if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)
+   {                                               // Parameter validation
+      printf("Invalid starting point");
       return -1;
    }
    if (stream->lastop == 'w')                      // Flush written data
    {
-      fflush(stream);
+      fflush_unlocked(stream);
    }
-
-   lseek(stream->fd, 0, 0);
-   int fileSize = lseek(stream->fd, 0, SEEK_END);  // Get max file size
-
-
-   if (offset < 0)                                 // Relocate backwards
+   appendpos(stream);                              // Resolve append position
+   if (whence == SEEK_END && stream->lz != NULL)   // Size of the contents
    {
-      if (whence == SEEK_END)                      // Relocate from EOF
+      if (stream->fsize == -1 && lz_index(stream, -1) == -1)
       {
-         stream->fpos = fileSize + offset;         // Calc final position
-         lseek(stream->fd, stream->fpos, 0);       // Move to it
+         return -1;
       }
+   }
+   else if (whence == SEEK_END && !stream->mapped) // Others may have grown
+   {                                               //   the file, so fstat( )
+      fsize_refresh(stream);
+   }
+
+   off_t target = offset;                          // Final position
+   if (whence == SEEK_CUR)
+   {
+      target += stream->fpos;
+   }
+   else if (whence == SEEK_END)
+   {
+      target += stream->mapped ? stream->actual_size : stream->fsize;
+   }
+   if (target < 0)
+   {
+      printf("Invalid file position");
+      return -1;
+   }
 
-      else                                         // Relocate from file pos
+   if (stream->mapped)                             // Pointer arithmetic only
+   {
+      if (target != stream->fpos && stream->seqhint) // Access turned random
       {
-         stream->fpos = stream->fpos + offset;
-         lseek(stream->fd, stream->fpos, 0);
+         madvise(stream->buffer, stream->size, MADV_RANDOM);
+         stream->seqhint = false;
       }
+      stream->fpos = target;
+      stream->pos = (target < stream->actual_size) ? target
+         : stream->actual_size;
+      return 0;
    }
 
-   else                                            // Relocate forwards
+   off_t bufstart = stream->fpos - stream->pos;    // File offset of buffer[0]
+   if (stream->lastop == 'r' && target >= bufstart &&
+      target <= bufstart + stream->actual_size)    // Already in the buffer
+   {
+      stream->pos = target - bufstart;
+      stream->fpos = target;
+      return 0;
+   }
+   if (stream->lz != NULL)                         // Jump to a block
    {
-      stream->fpos = whence + offset;
-      lseek(stream->fd, stream->fpos, 0);
+      return lz_seek(stream, target);
    }
 
-   if (stream->fpos >= fileSize)                   // Set EOF when applicable
-      stream->eof = true;
-   else
-      stream->eof = false;
+   if (stream->ra != NULL)                         // Drop read-ahead block
+   {
+      ra_cancel(stream);
+   }
+   if (!stream->direct &&
+      io_lseek(stream, target, SEEK_SET) == -1)    // Move to the target
+   {
+      printf("Invalid file position");
+      return -1;
+   }
+   stream->fpos = target;
+   stream->pos = 0;                                // Buffer no longer valid
+   stream->actual_size = 0;
+   stream->lastop = 0;
+   adapt_seek(stream);                             // Resize to access pattern
+   if (stream->direct)                             // Buffer starts on a block
+   {
+      stream->pos = target & (DIO_ALIGN - 1);
+      stream->actual_size = stream->pos;
+      stream->dhead = stream->pos;
+   }
+
+   if (target >= stream->fsize)                    // Check the size is current
+   {
+      fsize_refresh(stream);
+   }
+   stream->eof = (stream->fsize != -1 &&           // Set EOF when applicable
+      target >= stream->fsize);
 
    return 0;
+} // end fseek_unlocked
+
+// ---------------------------------------------------- fseek(FILE*, long, int)
+// Locks the stream around fseek_unlocked( )
+//
+int fseek(FILE* stream, long offset, int whence)
+{
+   flockfile(stream);
+   int result = fseek_unlocked(stream, offset, whence);
+   funlockfile(stream);
+   return result;
 } // end fseek
 
+// -------------------------------------------------- fseeko(FILE*, off_t, int)
+// fseek( ) with a 64-bit offset, for files larger than a long can reach
+//
+int fseeko(FILE* stream, off_t offset, int whence)
+{
+   flockfile(stream);
+   int result = fseek_unlocked(stream, offset, whence);
+   funlockfile(stream);
+   return result;
+} // end fseeko
+
+// --------------------------------------------------------------- ftell(FILE*)
+// Returns the current position in the file
+// The position is tracked in fpos, so no system call is made unless an
+//   append stream has written since it was last asked, see appendpos( )
+//
+// param: stream  Pointer to the file object being checked
+//
+// pre:    File has been opened and initialized
+// return: Offset from the start of the file, -1 on error
+//
+long ftell(FILE* stream)
+{
+   if (stream == nullptr)                          // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+
+   flockfile(stream);
+   appendpos(stream);
+   long result = stream->fpos;
+   funlockfile(stream);
+   return result;
+} // end ftell
+
+// -------------------------------------------------------------- ftello(FILE*)
+// ftell( ) with a 64-bit result, for files larger than a long can reach
+//
+off_t ftello(FILE* stream)
+{
+   if (stream == nullptr)                          // Parameter validation
+   {
+      printf("Null file parameter");
+      return -1;
+   }
+
+   flockfile(stream);
+   appendpos(stream);
+   off_t result = stream->fpos;
+   funlockfile(stream);
+   return result;
+} // end ftello
+
+// ---------------------------------------------------- fgetpos(FILE*, fpos_t*)
+// Stores the current position in the file, as ftell( ) returns it
+//
+// param: stream  Pointer to the file object being checked
+// param: pos     Filled with the current position
+//
+// pre:    File has been opened and initialized
+// return: 0 on success, -1 on error
+//
+int fgetpos(FILE* stream, fpos_t* pos)
+{
+   if (stream == nullptr || pos == nullptr)        // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return -1;
+   }
+
+   flockfile(stream);
+   appendpos(stream);
+   *pos = stream->fpos;
+   funlockfile(stream);
+   return 0;
+} // end fgetpos
+
+// ---------------------------------------------- fsetpos(FILE*, const fpos_t*)
+// Returns to a position saved by fgetpos( )
+//
+// param: stream  Pointer to the file object being repositioned
+// param: pos     Position saved by fgetpos( )
+//
+// pre:    File has been opened and initialized
+// return: 0 on success, -1 on error
+//
+int fsetpos(FILE* stream, const fpos_t* pos)
+{
+   if (stream == nullptr || pos == nullptr)        // Parameter validation
+   {
+      printf("Null pointer parameter");
+      return -1;
+   }
+   return fseeko(stream, *pos, SEEK_SET);
+} // end fsetpos
+
+// -------------------------------------------------------------- rewind(FILE*)
+// Moves back to the start of the file
+//
+// param: stream  Pointer to the file object being repositioned
+//
+// pre:    File has been opened and initialized
+//
+void rewind(FILE* stream)
+{
+   fseek(stream, 0, SEEK_SET);
+} // end rewind
+
 // -------------------------------------------------------------- fclose(FILE*)
 // Deletes file buffer if owned by the parameter object
 // Closes the file descriptor for the file
@@ -933,19 +6930,53 @@ int fclose(FILE* stream)
       printf("Null file parameter");
       return -1;
    }
+   stream_unregister(stream);                      // Out of fflush(NULL)'s way
+   flockfile(stream);                              // Wait out other users
+   if (stream->ra != NULL)                         // Stop read-ahead worker
+   {
+      ra_stop(stream);
+   }
    if (stream->lastop == 'w')                      // Flush written data
    {
-      fflush(stream);
+      fflush_unlocked(stream);
    }
    else if (stream->lastop == 'r')                 // Purge buffer
    {
-      fpurge(stream);
+      fpurge_unlocked(stream);
+   }
+   if (stream->lz != NULL)                         // Last block is written
+   {
+      lz_stop(stream);
+   }
+   adapt_close(stream);                            // Drop a scan's pages
+   if (stream->ds != NULL)                         // Honour the policy
+   {
+      if (stream->ds->policy != _DSYNC_NONE &&
+         stream->ds->written > stream->ds->synced)
+      {
+         fdatasync(stream->fd);
+      }
+      pthread_mutex_destroy(&stream->ds->lock);
+      pthread_cond_destroy(&stream->ds->done);
+      delete stream->ds;
+   }
+   if (stream->mapped)                             // Unmap file if mapped
+   {
+      munmap(stream->buffer, stream->size);
+   }
+   else if (stream->bufown)                        // Return buffer if owned
+   {
+      bufpool_put(stream->buffer, stream->size);
    }
-   if (stream->bufown)                             // Delete buffer if owned
+   if (stream->ln != NULL)                         // Delete fgetln() buffer
    {
-      delete stream->buffer;
+      delete[] stream->ln->buf;
+      delete stream->ln;
    }
 
-   delete stream;                                  // Open new / Close delete
-   return close(stream->fd);                       // Close file, exeunt
+   funlockfile(stream);
+
+   int result = close(stream->fd);                 // Close file
+   file_free(stream);                              // Back to the FILE slab
+   return result;                                  // Exeunt
 } // end fclose
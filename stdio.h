@@ -17,12 +17,37 @@
  * Assumptions:
  * Append mode requires user to reposition after each write
  *   if switching to read (write will move to EOF)
+ * Append writes never seek: O_APPEND places them, and the position
+ *   is only read back from the kernel when ftell( ) or fseek( ) needs it
  * The underlying system calls work as intended
  * The user is responsible for using fseek() to reposition
  *   after writing in append mode, if attempting to read
  * A user calling fpurge() does so knowing all the content
  *   in the buffer will be overwritten with \0
  * fseek() sets EOF when applicable
+ * Buffers chosen by fopen( ) grow during sequential reads and shrink
+ *   again under random seeks; a buffer given to setvbuf( ) never changes
+ * Memory-mapped streams (mode modifier 'm') hold the whole file in
+ *   their buffer, so EOF is set as soon as they are opened
+ * Formatted input (fscanf( ), fread_int64( ), fread_double( ),
+ *   fread_token( )) needs a buffered stream to look ahead in
+ * Compressed streams (mode modifier 'z') are either read or written
+ *   from start to end; readers may seek, writers may not, and
+ *   fpread( ), fpwrite( ) and unbuffered modes are refused
+ * Direct streams (mode modifier 'd') need an aligned buffer a whole
+ *   number of blocks long; fpurge( ) keeps their partial last block, and
+ *   positional and unbuffered I/O are refused
+ * Line-buffered streams (_IOLBF, chosen by fopen( ) for terminals)
+ *   write complete lines once per call, up to the last newline written
+ * Written data reaches the file when the buffer fills, on fflush( ),
+ *   fflush(NULL), fclose( ) or exit( ), or once it is older than the
+ *   delay given to setflushdelay( ); _exit( ) and crashes lose it
+ * fcopy( ) flushes the destination and empties the source's buffer
+ *   before it hands the rest of a copy to the kernel
+ * Streams get their buffer on the first read or write, so a stream
+ *   only opened and closed costs no buffer memory
+ * Positions and sizes are 64-bit (off_t / ssize_t), so files and
+ *   setvbuf( ) buffers may be larger than 2 GB
  * The actual_size member is only updated on read() calls
  *   as a reference for the number of bytes last read
  *   Used to check for if EOF was reached inside the buffer
@@ -35,43 +60,149 @@
 #define _IONBF 0    // unbuffered
 #define _IOLBF 1    // line buffered
 #define _IOFBF 2    // fully buffered
+#define _IORA 3     // fully buffered with background read-ahead
 #define EOF -1      // end of file
 
-class FILE 
+#define _DSYNC_NONE 0     // leave write-back to the kernel
+#define _DSYNC_PERIODIC 1 // fdatasync( ) every N bytes or M milliseconds
+#define _DSYNC_GROUP 2    // fcommit( ) callers share one fdatasync( )
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t on 32-bit systems too
+#endif
+
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef off_t fpos_t; // file position saved by fgetpos( )
+
+struct rastate;    // background read-ahead state, see stdio.cpp
+struct dsyncstate; // durability policy state, see setdurability( )
+struct lzstate;    // block compression state, see setcompress( )
+struct adaptstate; // buffer sizing state, see adapt_open( )
+struct linestate;  // fgetln( ) buffer, see growline( )
+
+// Per-stream I/O counters reported by fstats( )
+// They are only kept when the library is built with STDIO_STATS
+struct fstats
+{
+  unsigned long reads;              // read( ) / pread( ) calls
+  unsigned long writes;             // write( ) calls
+  unsigned long seeks;              // lseek( ) calls
+  unsigned long long bytes_read;    // bytes returned by reads
+  unsigned long long bytes_written; // bytes accepted by writes
+  unsigned long refills;            // refill( ) calls
+  unsigned long flushes;            // fflush( )es that wrote data
+  unsigned long purges;             // fpurge( ) calls
+  unsigned long hits;               // fgetc( ) / fread( ) served by the buffer
+  unsigned long misses;             // fgetc( ) / fread( ) that had to read
+  unsigned long long syscall_ns;    // time spent in the calls above
+};
+
+class alignas(64) FILE 
 {
  public:
   FILE() 
   {
-     fd = 0;
-     pos = 0;
-     fpos = 0;
      buffer = (char *) 0;
-     size = 0;
+     pos = 0;
      actual_size = 0;
+     size = 0;
+     fpos = 0;
+     fd = 0;
      mode = _IONBF;
      flag = 0;
-     bufown = false;
      lastop = 0;
      eof = false;
+     bufown = false;
+     mapped = false;
+     direct = false;
+     astale = false;
+     autosize = false;
+     seqhint = false;
+     fsize = -1;
+     dhead = 0;
+     ra = (rastate *) 0;
+     ds = (dsyncstate *) 0;
+     lz = (lzstate *) 0;
+     ad = (adaptstate *) 0;
+     ln = (linestate *) 0;
+     next = prev = (FILE *) 0;
+     dirtysince = 0;
+#ifdef STDIO_STATS
+     stats = fstats();
+#endif
+
+     pthread_mutexattr_t attr;
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+     pthread_mutex_init(&lock, &attr);
+     pthread_mutexattr_destroy(&attr);
   }
 
+  ~FILE()
+  {
+     pthread_mutex_destroy(&lock);
+  }
 
+
+  // Hot: every getc( ), putc( ), fread( ) and fwrite( ) touches only
+  //   these, and they fill the first cache line of the object
+  char *buffer;    // an input or output file stream buffer, 0 until first used
+  ssize_t pos;     // the current file position in the buffer
+  ssize_t actual_size; // the actual buffer size when read( ) returns # bytes read smaller than size
+  ssize_t size;    // the buffer size
+  off_t fpos;      // the current file position in the file
   int fd;          // a Unix file descriptor of an opened file
-  int pos;         // the current file position in the buffer
-  int fpos;        // the current file position in the file
-  char *buffer;    // an input or output file stream buffer
-  int size;        // the buffer size
-  int actual_size; // the actual buffer size when read( ) returns # bytes read smaller than size
-  int mode;        // _IONBF, _IOLBF, _IOFBF
+  int mode;        // _IONBF, _IOLBF, _IOFBF, _IORA
   int flag;        // O_RDONLY 
                    // O_RDWR 
                    // O_WRONLY | O_CREAT | O_TRUNC
                    // O_WRONLY | O_CREAT | O_APPEND
                    // O_RDWR   | O_CREAT | O_TRUNC
                    // O_RDWR   | O_CREAT | O_APPEND
-  bool bufown;     // true if allocated by stdio.h or false by a user
   char lastop;     // 'r' or 'w' 
   bool eof;        // true if EOF is reached
+  bool bufown;     // true if allocated by stdio.h or false by a user
+  bool mapped;     // true if buffer is an mmap( ) of the whole file
+  bool direct;     // true if opened O_DIRECT (mode modifier 'd')
+  bool astale;     // true if append writes may have moved the end of file
+  bool autosize;   // true while the library picks the buffer size
+  bool seqhint;    // true while the mapping is advised MADV_SEQUENTIAL
+
+  // Cold: seeks, opens, closes and the optional features
+  off_t fsize;     // cached file size, -1 until known
+  ssize_t dhead;   // leading bytes of a direct buffer holding no file data
+  rastate *ra;     // read-ahead state once an _IORA stream first reads
+  dsyncstate *ds;  // durability state once setdurability( ) is called
+  lzstate *lz;     // compression state of a stream opened with 'z'
+  adaptstate *ad;  // access pattern once a sized stream first reads or seeks
+  linestate *ln;   // fgetln( ) buffer once a line crosses a refill
+  FILE *next;      // next open stream, for fflush(NULL)
+  FILE *prev;      // previous open stream
+  unsigned long long dirtysince; // ms time written data entered the buffer
+  pthread_mutex_t lock; // recursive lock, see flockfile( )
+#ifdef STDIO_STATS
+  struct fstats stats; // I/O counters, see fstats( )
+#endif
+};
+
+// Counters reported by bufpool_getstats( )
+struct bufpool_stats
+{
+  unsigned long hits;      // buffers reused from the pool
+  unsigned long misses;    // buffers that had to be allocated
+  unsigned long frees;     // buffers handed back to the pool
+  unsigned long released;  // pooled buffers given back to the system
 };
+
+// One record returned by fread_records( ), without its delimiter
+// It points into the stream and stays valid until the next operation
+struct record_view
+{
+  const char *data; // first byte of the record
+  size_t len;       // length of the record
+};
+
 #include "stdio.cpp"
 #endif
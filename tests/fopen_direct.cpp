@@ -0,0 +1,67 @@
+/** @file fopen_direct.cpp
+ *
+ * Checks that fopen( ) with the 'd' modifier fails like a plain fopen( )
+ *   when the file cannot be opened, and still opens files that can be
+ *   (falling back to buffered I/O where the filesystem refuses O_DIRECT)
+ *
+ *   g++ -O2 -o tests/fopen_direct tests/fopen_direct.cpp -lpthread && tests/fopen_direct [dir]
+ *
+ * Exits 0 when every check passes
+ */
+
+#include "../stdio.h"
+
+static int failures = 0;
+
+// --------------------------------------------------- check(bool, const char*)
+// Counts and reports a failed check
+//
+static void check(bool ok, const char* what)
+{
+   if (!ok)
+   {
+      printf("FAIL: %s\n", what);
+      failures++;
+   }
+} // end check
+
+int main(int argc, char** argv)
+{
+   const char* dir = (argc > 1) ? argv[1] : "/tmp";
+   char path[512];
+
+   FILE* stream = fopen("/nonexistent/fopen_direct/missing", "rd");
+   check(stream == NULL, "\"rd\" on a missing path returns NULL");
+
+   stream = fopen("/nonexistent/fopen_direct/missing", "r");
+   check(stream == NULL, "\"r\" on a missing path returns NULL");
+
+   stream = fopen("/nonexistent/fopen_direct/missing", "wd");
+   check(stream == NULL, "\"wd\" in a missing directory returns NULL");
+
+   snprintf(path, sizeof(path), "%s/fopen_direct.%d", dir, (int)getpid());
+   stream = fopen(path, "wd");
+   check(stream != NULL && stream->fd != -1, "\"wd\" on a new file opens");
+   if (stream != NULL)
+   {
+      check(fputs("direct\n", stream) >= 0, "write to a direct stream");
+      check(fclose(stream) == 0, "close a direct stream");
+   }
+
+   stream = fopen(path, "rd");
+   check(stream != NULL && stream->fd != -1, "\"rd\" on that file opens");
+   if (stream != NULL)
+   {
+      char line[16];
+      check(fgets(line, sizeof(line), stream) != NULL &&
+         strcmp(line, "direct\n") == 0, "read back what was written");
+      fclose(stream);
+   }
+   unlink(path);
+
+   if (failures == 0)
+   {
+      printf("fopen_direct: all checks passed\n");
+   }
+   return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+/** @file fpwrite_dsync.cpp
+ *
+ * Checks that fpwrite( ) data counts toward a stream's durability policy,
+ *   so fcommit( ) under _DSYNC_GROUP syncs positional writes instead of
+ *   returning early because nothing seemed to be pending
+ *
+ *   g++ -O2 -o tests/fpwrite_dsync tests/fpwrite_dsync.cpp -lpthread && tests/fpwrite_dsync [dir]
+ *
+ * Exits 0 when every check passes
+ */
+
+#include "../stdio.h"
+
+static int failures = 0;
+
+// --------------------------------------------------- check(bool, const char*)
+// Counts and reports a failed check
+//
+static void check(bool ok, const char* what)
+{
+   if (!ok)
+   {
+      printf("FAIL: %s\n", what);
+      failures++;
+   }
+} // end check
+
+int main(int argc, char** argv)
+{
+   const char* dir = (argc > 1) ? argv[1] : "/tmp";
+   char path[512];
+   char block[4096];
+
+   memset(block, 'p', sizeof(block));
+   snprintf(path, sizeof(path), "%s/fpwrite_dsync.%d", dir, (int)getpid());
+   FILE* stream = fopen(path, "w+");
+   check(stream != NULL, "open a scratch file");
+   if (stream == NULL)
+   {
+      return 1;
+   }
+   check(setdurability(stream, _DSYNC_GROUP, 0, 0) == 0,
+      "select _DSYNC_GROUP");
+
+   check(fpwrite(block, 1, sizeof(block), stream, 8192) == sizeof(block),
+      "fpwrite a block past the end");
+   check(stream->ds->written == sizeof(block),
+      "fpwrite counts toward the durability state");
+   check(stream->ds->synced < stream->ds->written,
+      "fpwrite data is pending before fcommit");
+
+   check(fcommit(stream) == 0, "fcommit after fpwrite");
+   check(stream->ds->synced == stream->ds->written,
+      "fcommit syncs the fpwrite data");
+
+   check(fwrite(block, 1, 100, stream) == 100, "fwrite after fcommit");
+   check(fpwrite(block, 1, 100, stream, 0) == 100, "fpwrite after fwrite");
+   check(fcommit(stream) == 0, "fcommit mixed writes");
+   check(stream->ds->written == sizeof(block) + 200 &&
+      stream->ds->synced == stream->ds->written,
+      "fcommit syncs buffered and positional data");
+
+   check(fclose(stream) == 0, "close the scratch file");
+   unlink(path);
+
+   if (failures == 0)
+   {
+      printf("fpwrite_dsync: all checks passed\n");
+   }
+   return (failures == 0) ? 0 : 1;
+}
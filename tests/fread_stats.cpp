@@ -0,0 +1,97 @@
+/** @file fread_stats.cpp
+ *
+ * Checks through the STDIO_STATS counters that an fread( ) larger than the
+ *   stream buffer costs one read syscall, the readv( ) that fills the
+ *   caller's memory and refills the buffer, and prints the counters
+ *
+ *   g++ -O2 -DSTDIO_STATS -o tests/fread_stats tests/fread_stats.cpp -lpthread && tests/fread_stats [dir]
+ *
+ * Exits 0 when every check passes
+ */
+
+#include "../stdio.h"
+
+#define STATS_BUF 65536                     // Stream buffer
+#define STATS_REQ (1024 * 1024)             // Bytes per fread( )
+#define STATS_REQS 16                       // Whole requests in the file
+#define STATS_TAIL 1000                     // Bytes past the last one
+
+static int failures = 0;
+
+// --------------------------------------------------- check(bool, const char*)
+// Counts and reports a failed check
+//
+static void check(bool ok, const char* what)
+{
+   if (!ok)
+   {
+      printf("FAIL: %s\n", what);
+      failures++;
+   }
+} // end check
+
+int main(int argc, char** argv)
+{
+   const char* dir = (argc > 1) ? argv[1] : "/tmp";
+   char path[512];
+   char* buf = new char[STATS_REQ];
+   struct fstats st;
+
+   snprintf(path, sizeof(path), "%s/fread_stats.%d", dir, (int)getpid());
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   check(fd != -1, "create the input file");
+   for (int i = 0; i < STATS_REQS && fd != -1; i++)
+   {
+      memset(buf, 'a' + i, STATS_REQ);
+      check(write(fd, buf, STATS_REQ) == STATS_REQ, "write the input file");
+   }
+   check(fd != -1 && write(fd, buf, STATS_TAIL) == STATS_TAIL,
+      "write the input tail");
+   close(fd);
+
+   FILE* stream = fopen(path, "r");
+   check(stream != NULL, "open the input file");
+   if (stream == NULL)
+   {
+      delete[] buf;
+      return 1;
+   }
+   setvbuf(stream, NULL, _IOFBF, STATS_BUF);
+   check(fstats(stream, &st) == 0, "fstats needs a -DSTDIO_STATS build");
+
+   size_t got = 0;
+   int requests = 0;
+   for (int i = 0; i < STATS_REQS; i++)
+   {
+      size_t n = fread(buf, 1, STATS_REQ, stream);
+      requests++;
+      got += n;
+      check(n == STATS_REQ && buf[0] == 'a' + i &&
+         buf[STATS_REQ - 1] == 'a' + i, "a large fread returns its record");
+   }
+   size_t n = fread(buf, 1, STATS_REQ, stream); // Short, across EOF
+   requests++;
+   got += n;
+   check(n == STATS_TAIL, "the last fread stops at EOF");
+   check(feof(stream), "EOF is set after the short read");
+
+   fstats(stream, &st);
+   printf("fread_stats: %d requests of %d bytes, %lu reads, %llu bytes, "
+      "%lu refills, %lu hits, %lu misses, %lu seeks, %llu ns in syscalls\n",
+      requests, STATS_REQ, st.reads, st.bytes_read, st.refills, st.hits,
+      st.misses, st.seeks, st.syscall_ns);
+   check(st.bytes_read == got, "bytes_read matches what fread returned");
+   check(st.reads <= (unsigned long)requests + 1,
+      "at most one read syscall per large request, plus the EOF read");
+   fstats_dumpall(1);
+
+   fclose(stream);
+   unlink(path);
+   delete[] buf;
+
+   if (failures == 0)
+   {
+      printf("fread_stats: all checks passed\n");
+   }
+   return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+/** @file largefile.cpp
+ *
+ * Checks 64-bit offsets on a sparse file that reaches past 4 GiB: fseek( )
+ *   there, fwrite( ) and fpwrite( ), then ftell( ), fseek( ) and fread( )
+ *   back, including a record that straddles the 4 GiB boundary
+ * Only the written blocks take disk space
+ *
+ *   g++ -O2 -o tests/largefile tests/largefile.cpp -lpthread && tests/largefile [dir]
+ *
+ * Exits 0 when every check passes
+ */
+
+#include "../stdio.h"
+
+#define GiB (1024LL * 1024 * 1024)
+
+static int failures = 0;
+
+// --------------------------------------------------- check(bool, const char*)
+// Counts and reports a failed check
+//
+static void check(bool ok, const char* what)
+{
+   if (!ok)
+   {
+      printf("FAIL: %s\n", what);
+      failures++;
+   }
+} // end check
+
+// ------------------------------------------ readat(FILE*, off_t, const char*)
+// Seeks to an offset and checks that the bytes there are the expected ones
+//
+// return: true when they match
+//
+static bool readat(FILE* stream, off_t off, const char* want)
+{
+   char got[32];
+   size_t len = strlen(want);
+   if (fseeko(stream, off, SEEK_SET) != 0 || ftello(stream) != off)
+   {
+      return false;
+   }
+   return fread(got, 1, len, stream) == len && memcmp(got, want, len) == 0 &&
+      ftello(stream) == off + (off_t)len;
+} // end readat
+
+int main(int argc, char** argv)
+{
+   const char* dir = (argc > 1) ? argv[1] : "/tmp";
+   char path[512];
+   const off_t straddle = 4 * GiB - 3;      // Crosses the 32-bit boundary
+   const off_t far = 5 * GiB + 1;
+   const off_t end = 6 * GiB + 7;
+
+   snprintf(path, sizeof(path), "%s/largefile.%d", dir, (int)getpid());
+   FILE* stream = fopen(path, "w+");
+   check(stream != NULL, "open a scratch file");
+   if (stream == NULL)
+   {
+      return 1;
+   }
+   setvbuf(stream, NULL, _IOFBF, 1024 * 1024);
+
+   check(fseeko(stream, straddle, SEEK_SET) == 0, "fseeko to 4 GiB - 3");
+   check(fwrite("straddle", 1, 8, stream) == 8, "fwrite across 4 GiB");
+   check(ftello(stream) == straddle + 8, "ftello after the straddling write");
+
+   check(fseek(stream, (long)far, SEEK_SET) == 0, "fseek past 5 GiB");
+   check(ftell(stream) == (long)far, "ftell past 5 GiB");
+   check(fwrite("far", 1, 3, stream) == 3, "fwrite past 5 GiB");
+   check(ftello(stream) == far + 3, "ftello after the far write");
+
+   check(fpwrite("end", 1, 3, stream, end - 3) == 3, "fpwrite past 6 GiB");
+   check(ftello(stream) == far + 3, "fpwrite leaves the position alone");
+   check(fflush(stream) == 0, "flush the buffered writes");
+
+   check(fseeko(stream, 0, SEEK_END) == 0 && ftello(stream) == end,
+      "SEEK_END lands past 6 GiB");
+   check(fseeko(stream, -3, SEEK_CUR) == 0 && ftello(stream) == end - 3,
+      "SEEK_CUR back from the end");
+
+   check(readat(stream, straddle, "straddle"), "read back across 4 GiB");
+   check(readat(stream, far, "far"), "read back past 5 GiB");
+   check(readat(stream, end - 3, "end"), "read back the fpwrite data");
+   check(readat(stream, 4 * GiB, "addle"), "read from exactly 4 GiB");
+
+   char hole[4] = { 1, 1, 1, 1 };
+   check(fseeko(stream, far + 3, SEEK_SET) == 0 &&
+      fread(hole, 1, 4, stream) == 4 && memcmp(hole, "\0\0\0\0", 4) == 0,
+      "the hole reads as zeros");
+   char tail[8];
+   check(fseeko(stream, end - 3, SEEK_SET) == 0 &&
+      fread(tail, 1, sizeof(tail), stream) == 3 && feof(stream),
+      "fread stops at EOF");
+
+   check(fclose(stream) == 0, "close the scratch file");
+   struct stat sb;
+   check(stat(path, &sb) == 0 && sb.st_size == end, "the file size on disk");
+   unlink(path);
+
+   if (failures == 0)
+   {
+      printf("largefile: all checks passed\n");
+   }
+   return (failures == 0) ? 0 : 1;
+}